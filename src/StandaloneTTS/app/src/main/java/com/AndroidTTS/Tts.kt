@@ -13,6 +13,8 @@ import android.content.res.Resources
 import android.util.Log
 import com.StandaloneTTS.onnx.R
 import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 import java.nio.FloatBuffer
 import java.nio.IntBuffer
 import java.nio.LongBuffer
@@ -38,6 +40,16 @@ data class OfflineTtsConfig(
     var noiseScaleW: Float = 0.8f,
     var lengthScale: Float = 1.0f,
     val sampleRate: Int = 22050,
+    // Memory bound of the phonemized clause cache; 0 disables it.
+    var phonemeCacheBytes: Long = 4L shl 20,
+    // Optional file of text to phonemize at startup, one entry per line. The
+    // cache holds whole clauses as eSpeak ends them, so list prompts as they
+    // are spoken ("Battery low."), not single words.
+    var phonemePreloadList: String = "",
+    // Memory bound of the normalized text cache, spread over
+    // normalizerCacheShards independently locked shards; 0 disables it.
+    var normalizerCacheBytes: Long = 1L shl 20,
+    var normalizerCacheShards: Int = 16,
 )
 
 class GeneratedAudio(
@@ -70,8 +82,9 @@ class OfflineTts(
 
     init {
 
-        initEspeak(config.tokensFileName, config.dataDir)
-        normalizer = Normalizer(config.ruleFars)
+        initEspeak(config.tokensFileName, config.dataDir, config.phonemeCacheBytes, config.phonemePreloadList)
+        normalizer = Normalizer(config.ruleFars, cacheCapacityBytes = config.normalizerCacheBytes,
+            cacheShards = config.normalizerCacheShards)
 
         env = OrtEnvironment.getEnvironment()
         sessionOptions = OrtSession.SessionOptions()
@@ -114,10 +127,10 @@ class OfflineTts(
         return tokenMap
     }
 
-    private fun encoder( tokenVector: LongArray, sid: Int ): OrtSession.Result {
-        val shape = longArrayOf( 1, tokenVector.size.toLong() )
-        val inputTensor = OnnxTensor.createTensor(env, LongBuffer.wrap(tokenVector), shape)
-        val inputLengths = OnnxTensor.createTensor(env, LongBuffer.wrap(longArrayOf(tokenVector.size.toLong())), longArrayOf(1))
+    private fun encoder( tokenVector: LongBuffer, sid: Int ): OrtSession.Result {
+        val shape = longArrayOf( 1, tokenVector.remaining().toLong() )
+        val inputTensor = OnnxTensor.createTensor(env, tokenVector, shape)
+        val inputLengths = OnnxTensor.createTensor(env, LongBuffer.wrap(longArrayOf(tokenVector.remaining().toLong())), longArrayOf(1))
         val scales = OnnxTensor.createTensor(env, FloatBuffer.wrap(floatArrayOf(config.noiseScale, config.lengthScale, config.noiseScaleW)), longArrayOf(3))
         val sidTensor = OnnxTensor.createTensor(env, LongBuffer.wrap(longArrayOf(sid.toLong())), longArrayOf(1))
 
@@ -136,12 +149,13 @@ class OfflineTts(
         Log.d("StandaloneTTS", "text: $text")
         val (normText, normalizationTime) = measureTimedValue{ normalizer.normalize(text) }
         Log.d("StandaloneTTS", "normalizationTime: ${normalizationTime.inWholeMilliseconds}ms: $normText")
-        val (tokenIds, tokenizationTime) = measureTimedValue { convertTextToTokenIds(normText, "en-us") }
+        val (tokenIds, tokenizationTime) = measureTimedValue { convertTextToTokenIdsDirect(normText, "en-us") }
         Log.d("StandaloneTTS", "tokenizationTime: ${tokenizationTime.inWholeMilliseconds}ms: num tokens: ${tokenIds.size}")
 
-        for( tokenVector in tokenIds ) {
+        for( i in 0 until tokenIds.size ) {
+            val tokenVector = tokenIds.sentence(i)
             val (encoderOutput, encodingTime) = measureTimedValue { encoder(tokenVector, sid) }
-            Log.d("StandaloneTTS", "encodingTime: ${encodingTime.inWholeMilliseconds}ms: tokenVector size: ${tokenVector.size}")
+            Log.d("StandaloneTTS", "encodingTime: ${encodingTime.inWholeMilliseconds}ms: tokenVector size: ${tokenVector.remaining()}")
 
             val z : OnnxTensor = encoderOutput.get(0) as OnnxTensor
             val y_mask: OnnxTensor = encoderOutput.get(1) as OnnxTensor
@@ -182,12 +196,13 @@ class OfflineTts(
         Log.d("StandaloneTTS", "text: $text")
         val (normText, normalizationTime) = measureTimedValue{ normalizeText(text) }
         Log.d("StandaloneTTS", "normalizationTime: ${normalizationTime.inWholeMilliseconds}ms: $normText")
-        val (tokenIds, tokenizationTime) = measureTimedValue { convertTextToTokenIds(normText, "en-us") }
+        val (tokenIds, tokenizationTime) = measureTimedValue { convertTextToTokenIdsDirect(normText, "en-us") }
         Log.d("StandaloneTTS", "tokenizationTime: ${tokenizationTime.inWholeMilliseconds}ms: num tokens: ${tokenIds.size}")
 
-        for( tokenVector in tokenIds ) {
+        for( i in 0 until tokenIds.size ) {
+            val tokenVector = tokenIds.sentence(i)
             val (encoderOutput, encodingTime) = measureTimedValue { encoder(tokenVector, sid) }
-            Log.d("StandaloneTTS", "encodingTime: ${encodingTime.inWholeMilliseconds}ms: tokenVector size: ${tokenVector.size}")
+            Log.d("StandaloneTTS", "encodingTime: ${encodingTime.inWholeMilliseconds}ms: tokenVector size: ${tokenVector.remaining()}")
 
             val z : OnnxTensor = encoderOutput.get(0) as OnnxTensor
             val y_mask: OnnxTensor = encoderOutput.get(1) as OnnxTensor
@@ -256,29 +271,202 @@ class OfflineTts(
 //    private external fun getSampleRate(ptr: Long): Int
 //    private external fun getNumSpeakers(ptr: Long): Int
 //
-    private external fun initEspeak( tokensPath: String, dataDir: String ): Unit
+    private external fun initEspeak( tokensPath: String, dataDir: String, phonemeCacheBytes: Long, phonemePreloadList: String ): Unit
     private fun normalizeText(text: String): String {
         return text
     }
 
     private external fun convertTextToTokenIds(text: String, voice: String): List< LongArray >
 
-    class Normalizer constructor( farList: String) {
+    // Token IDs of all sentences of a text in one direct buffer, which ONNX
+    // tensors wrap without copying. Sentence i is ids[offsets[i], offsets[i + 1]).
+    class TokenIds(private val ids: LongBuffer, private val offsets: LongArray) {
+        val size: Int get() = offsets.size - 1
+
+        fun sentence(i: Int): LongBuffer {
+            val view = ids.duplicate()
+            view.limit(offsets[i + 1].toInt())
+            view.position(offsets[i].toInt())
+            return view.slice()
+        }
+    }
+
+    // Reused by each thread; the TokenIds of a call are valid until the next call.
+    private val tokenIdBuffer = ThreadLocal.withInitial {
+        ByteBuffer.allocateDirect(64 shl 10).order(ByteOrder.nativeOrder())
+    }
+
+    fun convertTextToTokenIdsDirect(text: String, voice: String): TokenIds {
+        var buffer = tokenIdBuffer.get()!!
+        val offsets = convertTextToTokenIdsDirect(text, voice, buffer)
+        val needed = offsets.last() * 8
+        if (needed > buffer.capacity()) {
+            buffer = ByteBuffer.allocateDirect(maxOf(needed.toInt(), 2 * buffer.capacity()))
+                .order(ByteOrder.nativeOrder())
+            tokenIdBuffer.set(buffer)
+            // The IDs are kept natively; only copy them, don't phonemize again.
+            check(copyLastTokenIds(buffer))
+        }
+        return TokenIds(buffer.asLongBuffer(), offsets)
+    }
+    private external fun convertTextToTokenIdsDirect(text: String, voice: String, ids: ByteBuffer): LongArray
+    private external fun copyLastTokenIds(ids: ByteBuffer): Boolean
+
+    data class PhonemeCacheStats(
+        val hits: Long,
+        val misses: Long,
+        val evictions: Long,
+        val entries: Long,
+        val bytes: Long,
+    )
+
+    fun phonemeCacheStats(): PhonemeCacheStats {
+        val s = getPhonemeCacheStatsImpl()
+        return PhonemeCacheStats(s[0], s[1], s[2], s[3], s[4])
+    }
+    private external fun getPhonemeCacheStatsImpl(): LongArray
+    external fun resetPhonemeCacheStats(): Unit
+
+    // Latency distribution in nanoseconds.
+    data class LatencyStats(
+        val count: Long,
+        val meanNs: Long,
+        val p50Ns: Long,
+        val p95Ns: Long,
+        val p99Ns: Long,
+        val maxNs: Long,
+    ) {
+        companion object {
+            // Reads the six values the native side writes for a latency at s[i].
+            fun from(s: LongArray, i: Int) = LatencyStats(s[i], s[i + 1], s[i + 2], s[i + 3], s[i + 4], s[i + 5])
+        }
+    }
+
+    // Where the time of convertTextToTokenIds goes. lockWait and espeak are per
+    // in-process eSpeak call, workers per round trip to the worker processes.
+    data class PhonemizerStats(
+        val total: LatencyStats,
+        val lockWait: LatencyStats,
+        val espeak: LatencyStats,
+        val workers: LatencyStats,
+        val mapping: LatencyStats,
+        val ids: LatencyStats,
+        val requests: Long,
+        val inputBytes: Long,
+        val chunks: Long,
+        val cachedChunks: Long,
+        val clauses: Long,
+        val sentences: Long,
+        val idsOut: Long,
+    )
+
+    fun phonemizerStats(): PhonemizerStats {
+        val s = getPhonemizerStatsImpl()
+        return PhonemizerStats(
+            LatencyStats.from(s, 0), LatencyStats.from(s, 6), LatencyStats.from(s, 12),
+            LatencyStats.from(s, 18), LatencyStats.from(s, 24), LatencyStats.from(s, 30),
+            s[36], s[37], s[38], s[39], s[40], s[41], s[42])
+    }
+    private external fun getPhonemizerStatsImpl(): LongArray
+    external fun resetPhonemizerStats(): Unit
+
+    // Keeps the last capacity requests that took at least thresholdMs; 0 disables.
+    external fun setPhonemizerSlowTraces(thresholdMs: Double, capacity: Int): Unit
+    // One line per slow request, oldest first.
+    fun phonemizerSlowTraces(): List<String> = getPhonemizerSlowTracesImpl().toList()
+    private external fun getPhonemizerSlowTracesImpl(): Array<String>
+
+    fun interface SegmentCallback {
+        // Called in input order for each normalized sentence. Return false to stop.
+        fun onSegment(index: Int, text: String): Boolean
+    }
+
+    data class NormalizerCacheStats(
+        val hits: Long,
+        val misses: Long,
+        val evictions: Long,
+        val entries: Long,
+        val bytes: Long,
+    )
+
+    data class NormalizerStageStats(
+        val name: String,
+        val calls: Long,
+        val states: Long,
+        val arcs: Long,
+        val inputBytes: Long,
+        val outputBytes: Long,
+        val emptyOutputs: Long,
+        val latency: LatencyStats,
+        // Sampled on one in 16 requests
+        val compose: LatencyStats,
+        val search: LatencyStats,
+    )
+
+    data class NormalizerStats(
+        val total: LatencyStats,
+        val cacheHits: Long,
+        val stages: List<NormalizerStageStats>,
+    )
+
+    // slowTraceMs > 0 keeps the last 32 requests that took at least that long.
+    // cacheCapacityBytes bounds the cache of normalized text (0 disables it),
+    // which is split into cacheShards independently locked shards.
+    class Normalizer constructor( farList: String, slowTraceMs: Double = 0.0,
+                                  cacheCapacityBytes: Long = 1L shl 20, cacheShards: Int = 16) {
         private var ptr: Long = 0
         init{
-            ptr = initNormalizer(farList)
+            ptr = initNormalizer(farList, slowTraceMs, cacheCapacityBytes, cacheShards)
         }
         fun normalize(text: String): String {
             return normalizeImpl(ptr, text)
         }
+        fun normalizeStreaming(text: String, callback: SegmentCallback): Int {
+            return normalizeStreamingImpl(ptr, text, callback)
+        }
+        fun cacheStats(): NormalizerCacheStats {
+            val s = getCacheStatsImpl(ptr)
+            return NormalizerCacheStats(s[0], s[1], s[2], s[3], s[4])
+        }
+        fun resetCacheStats() {
+            resetCacheStatsImpl(ptr)
+        }
+        fun stats(): NormalizerStats {
+            val s = getStatsImpl(ptr)
+            val names = getStageNamesImpl(ptr)
+            val stages = ArrayList<NormalizerStageStats>()
+            var i = 8
+            for (k in 0 until s[7].toInt()) {
+                stages.add(NormalizerStageStats(
+                    names.getOrElse(k) { "" }, s[i], s[i + 1], s[i + 2], s[i + 3], s[i + 4], s[i + 5],
+                    LatencyStats.from(s, i + 6), LatencyStats.from(s, i + 12), LatencyStats.from(s, i + 18)))
+                i += 24
+            }
+            return NormalizerStats(LatencyStats.from(s, 0), s[6], stages)
+        }
+        fun resetStats() {
+            resetStatsImpl(ptr)
+        }
+        // One line per slow request, oldest first.
+        fun slowTraces(): List<String> {
+            return getSlowTracesImpl(ptr).toList()
+        }
 
         inner class C {
             protected fun finalize() {
                 cleanupNormalizer(ptr)
             }
         }
-        private external fun initNormalizer(farList: String): Long
+        private external fun initNormalizer(farList: String, slowTraceMs: Double,
+                                            cacheCapacityBytes: Long, cacheShards: Int): Long
         private external fun normalizeImpl(ptr: Long, text: String): String
+        private external fun normalizeStreamingImpl(ptr: Long, text: String, callback: SegmentCallback): Int
+        private external fun getCacheStatsImpl(ptr: Long): LongArray
+        private external fun resetCacheStatsImpl(ptr: Long): Unit
+        private external fun getStatsImpl(ptr: Long): LongArray
+        private external fun getStageNamesImpl(ptr: Long): Array<String>
+        private external fun resetStatsImpl(ptr: Long): Unit
+        private external fun getSlowTracesImpl(ptr: Long): Array<String>
         private external fun cleanupNormalizer(ptr: Long): Unit
     }
 
@@ -0,0 +1,525 @@
+//
+// Host benchmark of the text front end: normalization with the FST rules and
+// phonemization with eSpeak-ng into token IDs.
+//
+// Usage: tts_bench [options]
+//   --far-list <list>          comma separated FARs; skips normalization if unset
+//   --tokens <tokens.txt>      with --espeak-data, enables phonemization
+//   --espeak-data <dir>        eSpeak-ng data directory
+//   --voice <voice>            eSpeak voice, default en-us
+//   --corpus <file>            one sentence or paragraph per line, in a form
+//                              the FARs accept
+//   --sentences <n>            corpus lines joined into one request, default 1
+//   --requests <n>             requests replayed per thread, default 500
+//   --warmup <n>               untimed requests before each stage, default 20
+//   --threads <n>              threads replaying the requests, default 1
+//   --normalizer-cache-bytes <n>  default 0 (disabled)
+//   --phoneme-cache-bytes <n>     default 0 (disabled)
+//   --espeak-worker <path>     espeak_worker executable, for --espeak-workers
+//   --espeak-workers <n>       eSpeak worker processes, default 0 (in-process)
+//   --lookahead <0|1>          compose with lookahead matchers, default 0
+//   --verify <0|1>             check the output before timing, default 1
+//   --format <text|json>       json writes one object per stage and line
+//   --output <file>            write the results here instead of stdout
+//   --baseline <file>          json results of an earlier run to compare with
+//   --tolerance <x>            allowed relative regression, default 0.10
+//
+// Stages:
+//   normalizer_load, espeak_init  startup time and resident memory added
+//   normalize    Normalizer::apply
+//   phonemize    convertTextToTokenIds
+//   pipeline     both, the normalized text going to the phonemizer
+//   normalize.<i>     grammar stage i (in FAR list order) of normalize, from
+//                     Normalizer::stats(); compose_us and search_us are sampled
+//   phonemize.phases  mean time per phonemize request in each phase, from
+//                     getPhonemizerStats()
+// For the replay stages the latency percentiles are over all requests of
+// all threads, and peak_rss_kb is the peak resident memory during the stage.
+//
+// With --baseline every metric is compared with the same stage of the
+// baseline run, and the exit code is 2 if any got worse by more than the
+// tolerance.
+//
+// If a cache, worker processes or lookahead are configured, the normalized
+// text and token IDs of every request (and, for the pipeline, of its
+// normalized text) are first compared with those of a run without any of
+// them, and the exit code is 3 if they differ.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "espeak_lib.h"
+#include "openfst_api.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const char *kDefaultCorpus[] = {
+        "You have 3 new messages from Dr. Smith.",
+        "Battery at 15%. Connect your charger.",
+        "Meeting at 10:30 am on 17 May 2024 in room 4B.",
+        "Your order of $20.01 has shipped and will arrive on 10/06/2024.",
+        "Turn left onto 1st St in 500 ft, then continue for 2.5 miles.",
+        "It is 72 degrees and sunny; the high today is 81.",
+        "He weighs 4 1/2 lbs and is 23 inches long.",
+        "The quick brown fox jumps over the lazy dog.",
+        "Dr. Jones moved from St. Louis to join the U.S. Army in 1998.",
+        "J. R. R. Tolkien wrote it... and then, well... nothing more.",
+        "The rate rose 3.5 points to 12.75, i.e. more than expected.",
+};
+
+struct Options {
+    std::string far_list;
+    std::string tokens;
+    std::string espeak_data;
+    std::string voice = "en-us";
+    std::string corpus;
+    int sentences = 1;
+    int requests = 500;
+    int warmup = 20;
+    int threads = 1;
+    size_t normalizer_cache_bytes = 0;
+    size_t phoneme_cache_bytes = 0;
+    std::string espeak_worker;
+    int espeak_workers = 0;
+    bool lookahead = false;
+    bool verify = true;
+    bool json = false;
+    std::string output;
+    std::string baseline;
+    double tolerance = 0.10;
+};
+
+// One line of results: a stage name and its metrics, in output order.
+struct StageResult {
+    std::string stage;
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+static long ProcStatusKb(const char *field) {
+    std::ifstream is("/proc/self/status");
+    std::string line;
+    const size_t n = strlen(field);
+    while (std::getline(is, line)) {
+        if (line.compare(0, n, field) == 0) {
+            return atol(line.c_str() + n);
+        }
+    }
+    return -1;
+}
+
+// Resets the peak resident memory (VmHWM) to the current value, if the
+// kernel allows it.
+static void ResetPeakRss() {
+    std::ofstream os("/proc/self/clear_refs");
+    os << "5";
+}
+
+static double Percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted[i];
+}
+
+// Replays requests from opts.threads threads and collects the latency of
+// each call. reset_stats, if given, is called between warmup and replay.
+static StageResult Replay(const std::string &stage, const Options &opts,
+                          const std::vector<std::string> &requests,
+                          const std::function<void(const std::string &)> &run,
+                          const std::function<void()> &reset_stats = nullptr) {
+    for (int i = 0; i < opts.warmup; ++i) {
+        run(requests[i % requests.size()]);
+    }
+    if (reset_stats) reset_stats();
+    ResetPeakRss();
+
+    std::vector<std::vector<double>> latencies(opts.threads);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opts.threads; ++t) {
+        threads.emplace_back([&, t]() {
+            auto &us = latencies[t];
+            us.reserve(opts.requests);
+            for (int i = 0; i < opts.requests; ++i) {
+                const std::string &request = requests[(i + t) % requests.size()];
+                auto request_start = Clock::now();
+                run(request);
+                us.push_back(std::chrono::duration<double, std::micro>(
+                        Clock::now() - request_start).count());
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> us;
+    double chars = 0;
+    for (int t = 0; t < opts.threads; ++t) {
+        us.insert(us.end(), latencies[t].begin(), latencies[t].end());
+        for (int i = 0; i < opts.requests; ++i) {
+            chars += requests[(i + t) % requests.size()].size();
+        }
+    }
+    double sum = 0;
+    for (double v : us) sum += v;
+    std::sort(us.begin(), us.end());
+
+    return {stage,
+            {{"requests", double(us.size())},
+             {"mean_us", sum / us.size()},
+             {"p50_us", Percentile(us, 0.50)},
+             {"p95_us", Percentile(us, 0.95)},
+             {"p99_us", Percentile(us, 0.99)},
+             {"requests_per_s", us.size() / seconds},
+             {"chars_per_s", chars / seconds},
+             {"peak_rss_kb", double(ProcStatusKb("VmHWM:"))}}};
+}
+
+// Times a startup step and the resident memory it adds.
+static StageResult Startup(const std::string &stage, const std::function<void()> &init) {
+    long rss_before = ProcStatusKb("VmRSS:");
+    auto start = Clock::now();
+    init();
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    return {stage, {{"ms", ms}, {"rss_kb", double(ProcStatusKb("VmRSS:") - rss_before)}}};
+}
+
+static std::string FormatJson(const StageResult &result) {
+    std::string line = "{\"stage\":\"" + result.stage + "\"";
+    char value[64];
+    for (const auto &metric : result.metrics) {
+        snprintf(value, sizeof(value), "%.3f", metric.second);
+        line += ",\"" + metric.first + "\":" + value;
+    }
+    return line + "}";
+}
+
+static std::string FormatText(const StageResult &result) {
+    std::string line = result.stage;
+    line.resize(std::max<size_t>(line.size(), 16), ' ');
+    char value[96];
+    for (const auto &metric : result.metrics) {
+        snprintf(value, sizeof(value), " %s=%.2f", metric.first.c_str(), metric.second);
+        line += value;
+    }
+    return line;
+}
+
+// Reads the results of an earlier run written with --format json.
+static std::map<std::string, std::map<std::string, double>> ReadBaseline(
+        const std::string &path) {
+    std::map<std::string, std::map<std::string, double>> stages;
+    std::ifstream is(path);
+    std::string line;
+    while (std::getline(is, line)) {
+        const std::string stage_key = "\"stage\":\"";
+        size_t pos = line.find(stage_key);
+        if (pos == std::string::npos) continue;
+        pos += stage_key.size();
+        std::string stage = line.substr(pos, line.find('"', pos) - pos);
+
+        auto &metrics = stages[stage];
+        while ((pos = line.find(",\"", pos)) != std::string::npos) {
+            size_t name_end = line.find('"', pos + 2);
+            if (name_end == std::string::npos || line[name_end + 1] != ':') break;
+            std::string name = line.substr(pos + 2, name_end - pos - 2);
+            metrics[name] = strtod(line.c_str() + name_end + 2, nullptr);
+            pos = name_end;
+        }
+    }
+    return stages;
+}
+
+// Lower is better for every metric except the throughputs.
+static bool HigherIsBetter(const std::string &metric) {
+    return metric == "requests_per_s" || metric == "chars_per_s";
+}
+
+// Prints the change of each metric against the baseline and returns the
+// number of regressions beyond the tolerance.
+static int CompareWithBaseline(const std::vector<StageResult> &results,
+                               const Options &opts, FILE *out) {
+    auto baseline = ReadBaseline(opts.baseline);
+    if (baseline.empty()) {
+        fprintf(stderr, "No results in baseline %s\n", opts.baseline.c_str());
+        return 0;
+    }
+
+    int regressions = 0;
+    fprintf(out, "%-16s %-16s %14s %14s %9s\n", "stage", "metric", "baseline", "current",
+            "change");
+    for (const auto &result : results) {
+        auto stage = baseline.find(result.stage);
+        if (stage == baseline.end()) continue;
+        for (const auto &metric : result.metrics) {
+            if (metric.first == "requests") continue;
+            auto base = stage->second.find(metric.first);
+            if (base == stage->second.end() || base->second <= 0) continue;
+
+            double change = metric.second / base->second - 1;
+            double worse = HigherIsBetter(metric.first) ? -change : change;
+            bool regressed = worse > opts.tolerance;
+            regressions += regressed;
+            fprintf(out, "%-16s %-16s %14.2f %14.2f %+8.1f%%%s\n", result.stage.c_str(),
+                    metric.first.c_str(), base->second, metric.second, 100 * change,
+                    regressed ? "  REGRESSION" : "");
+        }
+    }
+    return regressions;
+}
+
+static void PrintMismatch(const char *what, const std::string &input) {
+    fprintf(stderr, "Verify: %s differ from the reference for \"%s\"\n", what, input.c_str());
+}
+
+// Normalizes requests with config and with neither cache nor lookahead into
+// normalized, returns the number of requests whose text differs.
+static int VerifyNormalizer(const Options &opts, const NormalizerConfig &config,
+                            const std::vector<std::string> &requests,
+                            std::vector<std::string> *normalized) {
+    NormalizerConfig reference_config = config;
+    reference_config.cache_capacity_bytes = 0;
+    reference_config.use_lookahead = false;
+    Normalizer reference(opts.far_list, reference_config);
+    normalized->clear();
+    for (const auto &request : requests) normalized->push_back(reference.apply(request));
+    if (config.cache_capacity_bytes == 0 && !config.use_lookahead) return 0;
+
+    // A separate instance, so that the timed one starts with an empty cache.
+    Normalizer configured(opts.far_list, config);
+    std::vector<bool> bad(requests.size(), false);
+    for (int pass = 0; pass < 2; ++pass) {  // the second from the cache
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (configured.apply(requests[i]) != (*normalized)[i]) bad[i] = true;
+        }
+    }
+    int mismatches = 0;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        if (!bad[i]) continue;
+        PrintMismatch("normalized texts", requests[i]);
+        ++mismatches;
+    }
+    return mismatches;
+}
+
+// Phonemizes inputs with the configured cache and worker processes and with
+// neither, returns the number of inputs whose token IDs differ. Leaves the
+// phonemizer configured, with an empty cache.
+static int VerifyPhonemizer(const Options &opts, const PhonemeCacheConfig &config,
+                            const std::vector<std::string> &inputs) {
+    if (config.capacity_bytes == 0 && opts.espeak_workers == 0) return 0;
+
+    PhonemeCacheConfig reference_config = config;
+    reference_config.capacity_bytes = 0;
+    stopEspeakProcessPool();
+    initEspeakLib(opts.tokens, opts.espeak_data, reference_config);
+    std::vector<std::vector<std::vector<int64_t>>> expected;
+    for (const auto &input : inputs) expected.push_back(convertTextToTokenIds(input, opts.voice));
+
+    initEspeakLib(opts.tokens, opts.espeak_data, config);
+    if (opts.espeak_workers > 0) startEspeakProcessPool(opts.espeak_worker, opts.espeak_workers);
+    std::vector<bool> bad(inputs.size(), false);
+    for (int pass = 0; pass < 2; ++pass) {  // the second from the cache
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (convertTextToTokenIds(inputs[i], opts.voice) != expected[i]) bad[i] = true;
+        }
+    }
+    int mismatches = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (!bad[i]) continue;
+        PrintMismatch("token IDs", inputs[i]);
+        ++mismatches;
+    }
+    initEspeakLib(opts.tokens, opts.espeak_data, config);
+    return mismatches;
+}
+
+static bool ParseOptions(int argc, char **argv, Options *opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", flag.c_str());
+            return false;
+        }
+        const char *value = argv[++i];
+        if (flag == "--far-list") opts->far_list = value;
+        else if (flag == "--tokens") opts->tokens = value;
+        else if (flag == "--espeak-data") opts->espeak_data = value;
+        else if (flag == "--voice") opts->voice = value;
+        else if (flag == "--corpus") opts->corpus = value;
+        else if (flag == "--sentences") opts->sentences = std::max(1, atoi(value));
+        else if (flag == "--requests") opts->requests = std::max(1, atoi(value));
+        else if (flag == "--warmup") opts->warmup = std::max(0, atoi(value));
+        else if (flag == "--threads") opts->threads = std::max(1, atoi(value));
+        else if (flag == "--normalizer-cache-bytes") opts->normalizer_cache_bytes = atoll(value);
+        else if (flag == "--phoneme-cache-bytes") opts->phoneme_cache_bytes = atoll(value);
+        else if (flag == "--espeak-worker") opts->espeak_worker = value;
+        else if (flag == "--espeak-workers") opts->espeak_workers = std::max(0, atoi(value));
+        else if (flag == "--lookahead") opts->lookahead = atoi(value) != 0;
+        else if (flag == "--verify") opts->verify = atoi(value) != 0;
+        else if (flag == "--format") opts->json = strcmp(value, "json") == 0;
+        else if (flag == "--output") opts->output = value;
+        else if (flag == "--baseline") opts->baseline = value;
+        else if (flag == "--tolerance") opts->tolerance = atof(value);
+        else {
+            fprintf(stderr, "Unknown option %s\n", flag.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    if (!ParseOptions(argc, argv, &opts)) {
+        fprintf(stderr, "Usage: %s [--far-list <list>] [--tokens <file> --espeak-data <dir>] "
+                        "[--corpus <file>] [options], see tts_bench.cpp\n", argv[0]);
+        return 1;
+    }
+    const bool normalize = !opts.far_list.empty();
+    const bool phonemize = !opts.tokens.empty() && !opts.espeak_data.empty();
+    if (!normalize && !phonemize) {
+        fprintf(stderr, "Nothing to do: pass --far-list and/or --tokens and --espeak-data\n");
+        return 1;
+    }
+
+    std::vector<std::string> corpus;
+    if (!opts.corpus.empty()) {
+        std::ifstream is(opts.corpus);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) corpus.push_back(line);
+        }
+    } else {
+        corpus.assign(std::begin(kDefaultCorpus), std::end(kDefaultCorpus));
+    }
+    if (corpus.empty()) {
+        fprintf(stderr, "Empty corpus %s\n", opts.corpus.c_str());
+        return 1;
+    }
+
+    // Request i joins the lines starting at i * sentences, wrapping around.
+    std::vector<std::string> requests(corpus.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        for (int k = 0; k < opts.sentences; ++k) {
+            if (k) requests[i] += ' ';
+            requests[i] += corpus[(i * opts.sentences + k) % corpus.size()];
+        }
+    }
+
+    std::vector<StageResult> results;
+
+    std::unique_ptr<Normalizer> normalizer;
+    if (normalize) {
+        NormalizerConfig config;
+        config.cache_capacity_bytes = opts.normalizer_cache_bytes;
+        config.use_lookahead = opts.lookahead;
+        results.push_back(Startup("normalizer_load", [&]() {
+            normalizer = std::make_unique<Normalizer>(opts.far_list, config);
+        }));
+    }
+    PhonemeCacheConfig phoneme_config;
+    phoneme_config.capacity_bytes = opts.phoneme_cache_bytes;
+    if (phonemize) {
+        results.push_back(Startup("espeak_init", [&]() {
+            initEspeakLib(opts.tokens, opts.espeak_data, phoneme_config);
+        }));
+        if (opts.espeak_workers > 0 &&
+            !startEspeakProcessPool(opts.espeak_worker, opts.espeak_workers)) {
+            fprintf(stderr, "Cannot start eSpeak workers %s\n", opts.espeak_worker.c_str());
+            return 1;
+        }
+    }
+
+    const bool reference_differs = opts.normalizer_cache_bytes > 0 || opts.lookahead ||
+                                   opts.phoneme_cache_bytes > 0 || opts.espeak_workers > 0;
+    if (opts.verify && reference_differs) {
+        int mismatches = 0;
+        std::vector<std::string> normalized;
+        if (normalize) {
+            NormalizerConfig config;
+            config.cache_capacity_bytes = opts.normalizer_cache_bytes;
+            config.use_lookahead = opts.lookahead;
+            mismatches += VerifyNormalizer(opts, config, requests, &normalized);
+        }
+        if (phonemize) {
+            std::vector<std::string> inputs = requests;
+            inputs.insert(inputs.end(), normalized.begin(), normalized.end());
+            mismatches += VerifyPhonemizer(opts, phoneme_config, inputs);
+        }
+        if (mismatches > 0) {
+            fprintf(stderr, "Verify: %d mismatches, not timing\n", mismatches);
+            return 3;
+        }
+    }
+
+    if (normalize) {
+        results.push_back(Replay("normalize", opts, requests, [&](const std::string &text) {
+            normalizer->apply(text);
+        }, [&]() { normalizer->resetStats(); }));
+
+        NormalizerStats stats = normalizer->stats();
+        for (size_t i = 0; i < stats.stages.size(); ++i) {
+            const NormalizerStageStats &stage = stats.stages[i];
+            const double calls = std::max<uint64_t>(1, stage.calls);
+            results.push_back({"normalize." + std::to_string(i),
+                               {{"mean_us", stage.latency.MeanNs() / 1e3},
+                                {"p95_us", stage.latency.PercentileNs(0.95) / 1e3},
+                                {"compose_us", stage.compose.MeanNs() / 1e3},
+                                {"search_us", stage.search.MeanNs() / 1e3},
+                                {"states", stage.states / calls},
+                                {"arcs", stage.arcs / calls}}});
+        }
+    }
+    if (phonemize) {
+        results.push_back(Replay("phonemize", opts, requests, [&](const std::string &text) {
+            thread_local TokenIdBuffer ids;
+            convertTextToTokenIds(text, opts.voice, ids);
+        }, resetPhonemizerStats));
+
+        PhonemizerStats stats = getPhonemizerStats();
+        const double calls = std::max<uint64_t>(1, stats.requests);
+        results.push_back({"phonemize.phases",
+                           {{"lock_wait_us", stats.lock_wait.total_ns / calls / 1e3},
+                            {"espeak_us", stats.espeak.total_ns / calls / 1e3},
+                            {"workers_us", stats.workers.total_ns / calls / 1e3},
+                            {"mapping_us", stats.mapping.total_ns / calls / 1e3},
+                            {"ids_us", stats.ids.total_ns / calls / 1e3},
+                            {"clauses", stats.clauses / calls}}});
+    }
+    if (normalize && phonemize) {
+        results.push_back(Replay("pipeline", opts, requests, [&](const std::string &text) {
+            thread_local TokenIdBuffer ids;
+            convertTextToTokenIds(normalizer->apply(text), opts.voice, ids);
+        }));
+    }
+
+    FILE *out = stdout;
+    if (!opts.output.empty()) {
+        out = fopen(opts.output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write %s\n", opts.output.c_str());
+            return 1;
+        }
+    }
+    for (const auto &result : results) {
+        fprintf(out, "%s\n", (opts.json ? FormatJson(result) : FormatText(result)).c_str());
+    }
+    if (out != stdout) fclose(out);
+
+    if (!opts.baseline.empty() && CompareWithBaseline(results, opts, stdout) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+//
+// Low-overhead latency and counter statistics shared by the normalizer and
+// the phonemizer.
+//
+// Recording never locks: each thread updates its own cache line sized slot
+// with relaxed atomics (threads beyond kStatSlots share slots), and the slots
+// are only summed when the statistics are read.
+//
+
+#ifndef ANDROIDTTS_STAGE_STATS_H
+#define ANDROIDTTS_STAGE_STATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Histogram buckets are a quarter of a power of two wide, from 1 ns up to
+// about 2^40 ns (18 minutes), so percentiles are accurate to within 19%.
+constexpr int kLatencySubBuckets = 4;
+constexpr int kLatencyBuckets = 40 * kLatencySubBuckets;
+
+constexpr int kStatSlots = 8;
+
+inline uint64_t StatsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int LatencyBucket(uint64_t ns) {
+    if (ns < kLatencySubBuckets) return static_cast<int>(ns);
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = static_cast<int>((ns >> (msb - 2)) & (kLatencySubBuckets - 1));
+    return std::min(kLatencyBuckets - 1, (msb - 1) * kLatencySubBuckets + sub);
+}
+
+// Smallest latency that falls into the bucket after b.
+inline uint64_t LatencyBucketLimit(int b) {
+    if (b + 1 < kLatencySubBuckets) return b + 1;
+    int msb = (b + 1) / kLatencySubBuckets + 1;
+    int sub = (b + 1) % kLatencySubBuckets;
+    return (uint64_t(kLatencySubBuckets) + sub) << (msb - 2);
+}
+
+// Slot of the calling thread, assigned round-robin on first use.
+inline int StatSlot() {
+    static std::atomic<int> next{0};
+    thread_local int slot = next.fetch_add(1, std::memory_order_relaxed) % kStatSlots;
+    return slot;
+}
+
+// Snapshot of a latency distribution.
+struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, kLatencyBuckets> buckets{};
+
+    double MeanNs() const { return count ? double(total_ns) / count : 0; }
+
+    // Upper bound of the bucket holding the p-th fraction of the samples.
+    uint64_t PercentileNs(double p) const {
+        if (count == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * count + 0.5));
+        uint64_t seen = 0;
+        for (int b = 0; b < kLatencyBuckets; ++b) {
+            seen += buckets[b];
+            if (seen >= rank) return std::min(max_ns, LatencyBucketLimit(b) - 1);
+        }
+        return max_ns;
+    }
+};
+
+// Appends {count, mean, p50, p95, p99, max} of stats, in ns, to out; the
+// layout of latencies in the stats arrays returned over JNI.
+inline void AppendLatencySummary(const LatencyStats &stats, std::vector<int64_t> *out) {
+    out->push_back(static_cast<int64_t>(stats.count));
+    out->push_back(static_cast<int64_t>(stats.MeanNs()));
+    out->push_back(static_cast<int64_t>(stats.PercentileNs(0.50)));
+    out->push_back(static_cast<int64_t>(stats.PercentileNs(0.95)));
+    out->push_back(static_cast<int64_t>(stats.PercentileNs(0.99)));
+    out->push_back(static_cast<int64_t>(stats.max_ns));
+}
+
+class LatencyRecorder {
+public:
+    void Record(uint64_t ns) {
+        Slot &slot = slots_[StatSlot()];
+        slot.count.fetch_add(1, std::memory_order_relaxed);
+        slot.total_ns.fetch_add(ns, std::memory_order_relaxed);
+        slot.buckets[LatencyBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = slot.max_ns.load(std::memory_order_relaxed);
+        while (ns > max &&
+               !slot.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    LatencyStats Snapshot() const {
+        LatencyStats stats;
+        for (const Slot &slot : slots_) {
+            stats.count += slot.count.load(std::memory_order_relaxed);
+            stats.total_ns += slot.total_ns.load(std::memory_order_relaxed);
+            stats.max_ns = std::max(stats.max_ns, slot.max_ns.load(std::memory_order_relaxed));
+            for (int b = 0; b < kLatencyBuckets; ++b) {
+                stats.buckets[b] += slot.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+        return stats;
+    }
+
+    void Reset() {
+        for (Slot &slot : slots_) {
+            slot.count.store(0, std::memory_order_relaxed);
+            slot.total_ns.store(0, std::memory_order_relaxed);
+            slot.max_ns.store(0, std::memory_order_relaxed);
+            for (auto &bucket : slot.buckets) bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::array<std::atomic<uint64_t>, kLatencyBuckets> buckets{};
+    };
+    std::array<Slot, kStatSlots> slots_;
+};
+
+class StatCounter {
+public:
+    void Add(uint64_t n) {
+        slots_[StatSlot()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Sum() const {
+        uint64_t sum = 0;
+        for (const Slot &slot : slots_) sum += slot.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    void Reset() {
+        for (Slot &slot : slots_) slot.value.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Slot, kStatSlots> slots_;
+};
+
+// The most recent traces of requests slower than a threshold. Only slow
+// requests take the lock.
+template <class Trace>
+class SlowTraceLog {
+public:
+    SlowTraceLog(uint64_t threshold_ns, size_t capacity)
+            : threshold_ns_(threshold_ns), capacity_(capacity) {}
+
+    bool Enabled() const { return threshold_ns_.load(std::memory_order_relaxed) > 0; }
+    bool IsSlow(uint64_t ns) const {
+        uint64_t threshold_ns = threshold_ns_.load(std::memory_order_relaxed);
+        return threshold_ns > 0 && ns >= threshold_ns;
+    }
+
+    // Changes the threshold (0 disables the log) and drops the kept traces.
+    void Configure(uint64_t threshold_ns, size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        threshold_ns_.store(threshold_ns, std::memory_order_relaxed);
+        capacity_ = capacity;
+        traces_.clear();
+    }
+
+    void Add(Trace trace) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (capacity_ == 0) return;
+        while (traces_.size() >= capacity_) traces_.pop_front();
+        traces_.push_back(std::move(trace));
+    }
+
+    std::vector<Trace> Get() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::vector<Trace>(traces_.begin(), traces_.end());
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        traces_.clear();
+    }
+
+private:
+    std::atomic<uint64_t> threshold_ns_;
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::deque<Trace> traces_;
+};
+
+#endif //ANDROIDTTS_STAGE_STATS_H
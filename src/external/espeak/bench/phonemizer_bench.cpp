@@ -0,0 +1,84 @@
+//
+// Phonemizer throughput benchmark.
+//
+// Usage: phonemizer_bench <tokens> <espeak_data_dir> <espeak_worker> [text_file] [max_workers] [num_threads]
+//
+// Converts the paragraphs of text_file (or a built-in text) to token IDs from
+// num_threads threads, first with the in-process eSpeak and then with 1, 2,
+// ... max_workers worker processes, and reports the throughput of each run.
+// The phoneme cache is disabled so that every clause reaches eSpeak.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "espeak_lib.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const char *kDefaultText[] = {
+        "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs!",
+        "How vexingly quick daft zebras jump; the five boxing wizards jump quickly.",
+        "She sells sea shells by the sea shore, and the shells she sells are surely seashells.",
+        "Peter Piper picked a peck of pickled peppers. Where is the peck he picked?",
+};
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <tokens> <espeak_data_dir> <espeak_worker> [text_file] [max_workers] [num_threads]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> paragraphs;
+    if (argc > 4 && *argv[4]) {
+        std::ifstream is(argv[4]);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (!line.empty()) paragraphs.push_back(line);
+        }
+    } else {
+        for (int i = 0; i < 16; ++i) {
+            paragraphs.insert(paragraphs.end(), std::begin(kDefaultText), std::end(kDefaultText));
+        }
+    }
+    int max_workers = argc > 5 ? atoi(argv[5]) : (int) std::thread::hardware_concurrency();
+    int num_threads = argc > 6 ? atoi(argv[6]) : 4;
+
+    size_t bytes = 0;
+    for (const auto &p : paragraphs) bytes += p.size();
+
+    PhonemeCacheConfig cache_config;
+    cache_config.capacity_bytes = 0;
+    initEspeakLib(argv[1], argv[2], cache_config);
+
+    printf("%8s %12s %14s %14s\n", "workers", "ms", "paragraphs/s", "kB/s");
+    for (int workers = 0; workers <= max_workers; ++workers) {
+        if (!startEspeakProcessPool(argv[3], workers)) {
+            return 1;
+        }
+        // warm up the workers
+        convertTextToTokenIds(paragraphs[0], "en-us");
+
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&, t]() {
+                for (size_t i = t; i < paragraphs.size(); i += num_threads) {
+                    convertTextToTokenIds(paragraphs[i], "en-us");
+                }
+            });
+        }
+        for (auto &thread : threads) thread.join();
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        printf("%8d %12.2f %14.1f %14.1f\n", workers, ms,
+               paragraphs.size() * 1000.0 / ms, bytes / ms);
+    }
+    stopEspeakProcessPool();
+    return 0;
+}
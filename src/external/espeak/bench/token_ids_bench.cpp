@@ -0,0 +1,156 @@
+//
+// Phoneme to token ID microbenchmark.
+//
+// Usage: token_ids_bench <tokens> <espeak_data_dir> [text_file] [iterations]
+//
+// Warms the phoneme cache with the paragraphs of text_file (or a built-in
+// text), so that eSpeak is out of the measured path, then converts them
+// again with both convertTextToTokenIds() overloads. Reports the heap
+// allocations per call, counted by replacing the global operator new, and
+// the time per phoneme.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "espeak_lib.h"
+
+static std::atomic<uint64_t> allocations{0};
+
+// Every form of the global operator new and delete is replaced, so that no
+// allocation escapes the count and every pointer is released the way it was
+// allocated. The helpers are kept out of line: once free() is inlined into a
+// delete expression, GCC reports it as mismatched with the new.
+__attribute__((noinline)) static void *Allocate(size_t size, size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return malloc(size);
+    void *p = nullptr;
+    return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+}
+
+__attribute__((noinline)) static void Release(void *p) { free(p); }
+
+static void *AllocateOrThrow(size_t size, size_t alignment) {
+    if (void *p = Allocate(size, alignment)) return p;
+    throw std::bad_alloc();
+}
+
+constexpr size_t kDefaultAlignment = alignof(std::max_align_t);
+
+void *operator new(size_t size) { return AllocateOrThrow(size, kDefaultAlignment); }
+void *operator new[](size_t size) { return AllocateOrThrow(size, kDefaultAlignment); }
+void *operator new(size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return Allocate(size, kDefaultAlignment);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return Allocate(size, kDefaultAlignment);
+}
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Allocate(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept { Release(p); }
+void operator delete[](void *p) noexcept { Release(p); }
+void operator delete(void *p, size_t) noexcept { Release(p); }
+void operator delete[](void *p, size_t) noexcept { Release(p); }
+void operator delete(void *p, std::align_val_t) noexcept { Release(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { Release(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { Release(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { Release(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { Release(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { Release(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { Release(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { Release(p); }
+
+using Clock = std::chrono::steady_clock;
+
+static const char *kDefaultText[] = {
+        "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs!",
+        "How vexingly quick daft zebras jump; the five boxing wizards jump quickly.",
+        "She sells sea shells by the sea shore, and the shells she sells are surely seashells.",
+        "Peter Piper picked a peck of pickled peppers. Where is the peck he picked?",
+};
+
+struct Result {
+    double allocs_per_call;
+    double ns_per_phoneme;
+};
+
+template <class Convert>
+static Result Measure(const std::vector<std::string> &paragraphs, int iterations,
+                      size_t phonemes_per_pass, Convert convert) {
+    // one untimed pass grows any reused buffers
+    for (const auto &p : paragraphs) convert(p);
+
+    uint64_t allocs_before = allocations.load();
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const auto &p : paragraphs) convert(p);
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    uint64_t allocs = allocations.load() - allocs_before;
+
+    double calls = double(iterations) * paragraphs.size();
+    return {allocs / calls, ns / (double(iterations) * phonemes_per_pass)};
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <tokens> <espeak_data_dir> [text_file] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> paragraphs;
+    if (argc > 3 && *argv[3]) {
+        std::ifstream is(argv[3]);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (!line.empty()) paragraphs.push_back(line);
+        }
+    } else {
+        paragraphs.assign(std::begin(kDefaultText), std::end(kDefaultText));
+    }
+    int iterations = argc > 4 ? atoi(argv[4]) : 2000;
+
+    initEspeakLib(argv[1], argv[2]);
+
+    // Phonemes per pass: each sentence is BOS, (ID, pad) per phoneme, EOS.
+    size_t phonemes = 0;
+    TokenIdBuffer buffer;
+    for (const auto &p : paragraphs) {
+        convertTextToTokenIds(p, "en-us", buffer);
+        phonemes += (buffer.ids.size() - 2 * buffer.numSentences()) / 2;
+    }
+
+    Result nested = Measure(paragraphs, iterations, phonemes, [](const std::string &p) {
+        return convertTextToTokenIds(p, "en-us").size();
+    });
+    Result flat = Measure(paragraphs, iterations, phonemes, [&buffer](const std::string &p) {
+        convertTextToTokenIds(p, "en-us", buffer);
+        return buffer.numSentences();
+    });
+
+    printf("%-24s %14s %14s\n", "api", "allocs/call", "ns/phoneme");
+    printf("%-24s %14.2f %14.2f\n", "vector<vector<int64_t>>", nested.allocs_per_call,
+           nested.ns_per_phoneme);
+    printf("%-24s %14.2f %14.2f\n", "TokenIdBuffer", flat.allocs_per_call,
+           flat.ns_per_phoneme);
+    return 0;
+}
@@ -5,59 +5,209 @@
 #include <jni.h>
 
 #include <cinttypes>
+#include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
 #include "espeak_lib.h"
 
 #define LOGI(...) \
   ((void)__android_log_print(ANDROID_LOG_INFO, "espeak-jni", __VA_ARGS__))
 
+// phonemePreloadList is a file of clauses to phonemize into the cache at
+// startup, see PhonemeCacheConfig::preload_list; "" for none.
 extern "C" JNIEXPORT void JNICALL
 Java_com_StandaloneTTS_OfflineTts_initEspeak(JNIEnv *env, jobject thiz,
-                                                     jstring tokenPath, jstring dataDir)
+                                                     jstring tokenPath, jstring dataDir,
+                                                     jlong phonemeCacheBytes,
+                                                     jstring phonemePreloadList)
 {
     const char *p_tokenPath = env->GetStringUTFChars(tokenPath, nullptr);
     const char *p_dataDir = env->GetStringUTFChars(dataDir, nullptr);
+    const char *p_preloadList = env->GetStringUTFChars(phonemePreloadList, nullptr);
+
+    PhonemeCacheConfig cacheConfig;
+    cacheConfig.capacity_bytes = phonemeCacheBytes > 0 ? (size_t) phonemeCacheBytes : 0;
+    cacheConfig.preload_list = p_preloadList;
 
     LOGI("initEspeakLib tokenPath is: %s, dataDir is: %s", p_tokenPath, p_dataDir);
-    initEspeakLib(std::string(p_tokenPath), std::string(p_dataDir));
+    initEspeakLib(std::string(p_tokenPath), std::string(p_dataDir), cacheConfig);
 
+    env->ReleaseStringUTFChars(phonemePreloadList, p_preloadList);
     env->ReleaseStringUTFChars( dataDir, p_dataDir);
     env->ReleaseStringUTFChars(tokenPath, p_tokenPath);
 }
 
+// Returns {hits, misses, evictions, entries, bytes}.
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_getPhonemeCacheStatsImpl(JNIEnv *env, jobject thiz)
+{
+    PhonemeCacheStats stats = getPhonemeCacheStats();
+    jlong values[] = {(jlong) stats.hits, (jlong) stats.misses, (jlong) stats.evictions,
+                      (jlong) stats.entries, (jlong) stats.bytes};
+    jlongArray result = env->NewLongArray(5);
+    env->SetLongArrayRegion(result, 0, 5, values);
+    return result;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_StandaloneTTS_OfflineTts_resetPhonemeCacheStats(JNIEnv *env, jobject thiz)
+{
+    resetPhonemeCacheStats();
+}
+
+// Returns the total, lock wait, eSpeak, worker, mapping and ID latencies as
+// {count, mean, p50, p95, p99, max} in ns, followed by {requests, input bytes,
+// chunks, cached chunks, clauses, sentences, IDs}.
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_getPhonemizerStatsImpl(JNIEnv *env, jobject thiz)
+{
+    PhonemizerStats stats = getPhonemizerStats();
+    std::vector<int64_t> values;
+    for (const LatencyStats *latency : {&stats.total, &stats.lock_wait, &stats.espeak,
+                                        &stats.workers, &stats.mapping, &stats.ids}) {
+        AppendLatencySummary(*latency, &values);
+    }
+    values.insert(values.end(), {(int64_t) stats.requests, (int64_t) stats.input_bytes,
+                                 (int64_t) stats.chunks, (int64_t) stats.cached_chunks,
+                                 (int64_t) stats.clauses, (int64_t) stats.sentences,
+                                 (int64_t) stats.ids_out});
+    jlongArray result = env->NewLongArray(values.size());
+    env->SetLongArrayRegion(result, 0, values.size(), (const jlong *) values.data());
+    return result;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_StandaloneTTS_OfflineTts_resetPhonemizerStats(JNIEnv *env, jobject thiz)
+{
+    resetPhonemizerStats();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_StandaloneTTS_OfflineTts_setPhonemizerSlowTraces(JNIEnv *env, jobject thiz,
+                                                          jdouble thresholdMs, jint capacity)
+{
+    setPhonemizerSlowTraces(thresholdMs, capacity > 0 ? (size_t) capacity : 0);
+}
+
+// One line per slow request:
+// "<total us> us | wait <us>, espeak <us>, workers <us>, mapping <us>, ids <us> |
+//  <cached>/<chunks> chunks cached, <clauses> clauses, <ids> ids | <voice> | <input>"
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_getPhonemizerSlowTracesImpl(JNIEnv *env, jobject thiz)
+{
+    std::vector<PhonemizerTrace> traces = getPhonemizerSlowTraces();
+    jobjectArray result = env->NewObjectArray(traces.size(),
+                                              env->FindClass("java/lang/String"), nullptr);
+    char buf[256];
+    for (size_t i = 0; i < traces.size(); ++i) {
+        const PhonemizerTrace &trace = traces[i];
+        snprintf(buf, sizeof(buf),
+                 "%" PRIu64 " us | wait %" PRIu64 ", espeak %" PRIu64 ", workers %" PRIu64
+                 ", mapping %" PRIu64 ", ids %" PRIu64 " | %" PRIu64 "/%" PRIu64
+                 " chunks cached, %" PRIu64 " clauses, %" PRIu64 " ids | ",
+                 trace.total_ns / 1000, trace.lock_wait_ns / 1000, trace.espeak_ns / 1000,
+                 trace.workers_ns / 1000, trace.mapping_ns / 1000, trace.ids_ns / 1000,
+                 trace.cached_chunks, trace.chunks, trace.clauses, trace.ids_out);
+        std::string line = buf + trace.voice + " | " + trace.input;
+        jstring text = env->NewStringUTF(line.c_str());
+        env->SetObjectArrayElement(result, i, text);
+        env->DeleteLocalRef(text);
+    }
+    return result;
+}
+
 extern "C"
 JNIEXPORT jobject JNICALL
 Java_com_StandaloneTTS_OfflineTts_convertTextToTokenIds(JNIEnv *env, jobject thiz, jstring text,
                                                         jstring voice)
 {
+    // Looked up once; the class is kept alive by a global reference.
+    static jclass arrayListClass = (jclass) env->NewGlobalRef(env->FindClass("java/util/ArrayList"));
+    static jmethodID arrayListConstructor = env->GetMethodID(arrayListClass, "<init>", "(I)V");
+    static jmethodID addMethod = env->GetMethodID(arrayListClass, "add", "(Ljava/lang/Object;)Z");
 
     const char *p_text = env->GetStringUTFChars(text, nullptr);
     const char *p_voice = env->GetStringUTFChars(voice, nullptr);
 //    LOGI("string is: %s, voice is: %s", p_text, p_voice);
-    std::vector<std::vector<int64_t>> textTokens = convertTextToTokenIds(std::string(p_text), std::string(p_voice));
+    thread_local TokenIdBuffer textTokens;
+    convertTextToTokenIds(std::string(p_text), std::string(p_voice), textTokens);
+    env->ReleaseStringUTFChars(voice, p_voice);
+    env->ReleaseStringUTFChars(text, p_text);
 //    LOGI("past tokenization");
 
-    jclass arrayListClass = env->FindClass("java/util/ArrayList");
-//    LOGI("past arrayListClass");
-    jmethodID arrayListConstructor = env->GetMethodID(arrayListClass, "<init>", "()V");
-//    LOGI("past arrayListConstructor");
-    jmethodID addMethod = env->GetMethodID(arrayListClass, "add", "(Ljava/lang/Object;)Z");
-//    LOGI("past addMethod");
-
     // The list we're going to return:
-    jobject list = env->NewObject(arrayListClass, arrayListConstructor);
-//    LOGI("past list");
-
-    for(auto& tokenArray : textTokens) {
-//        LOGI("adding tokenArray size: %lu", tokenArray.size());
-        jlongArray longArray = env->NewLongArray(tokenArray.size());
-//        LOGI("past longArray");
-        env->SetLongArrayRegion(longArray, 0, tokenArray.size(), tokenArray.data());
-//        LOGI("past SetLongArrayRegion");
+    jobject list = env->NewObject(arrayListClass, arrayListConstructor,
+                                  (jint) textTokens.numSentences());
+
+    for (size_t i = 0; i < textTokens.numSentences(); ++i) {
+        const int64_t *tokenArray = textTokens.ids.data() + textTokens.offsets[i];
+        jsize size = textTokens.offsets[i + 1] - textTokens.offsets[i];
+        jlongArray longArray = env->NewLongArray(size);
+        env->SetLongArrayRegion(longArray, 0, size, tokenArray);
         // Add it to the list
         env->CallBooleanMethod(list, addMethod, longArray);
-//        LOGI("past CallBooleanMethod");
+        env->DeleteLocalRef(longArray);
     }
     return list;
 }
+
+// Token IDs of the last convertTextToTokenIdsDirect call on this thread,
+// kept so that a call with too small a buffer can be completed by
+// copyLastTokenIds without phonemizing the text again.
+static thread_local TokenIdBuffer directTokens;
+
+// Copies directTokens into the direct ByteBuffer ids if it fits, as native
+// order int64 starting at index 0.
+static bool CopyTokenIds(JNIEnv *env, jobject ids)
+{
+    auto *address = static_cast<int64_t *>(env->GetDirectBufferAddress(ids));
+    if (address == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "ids must be a direct ByteBuffer");
+        return false;
+    }
+    const size_t capacity = env->GetDirectBufferCapacity(ids) / sizeof(int64_t);
+    if (directTokens.ids.size() > capacity) return false;
+    std::memcpy(address, directTokens.ids.data(), directTokens.ids.size() * sizeof(int64_t));
+    return true;
+}
+
+// Writes the token IDs of all sentences into the direct ByteBuffer ids, as
+// native order int64 starting at index 0, and returns the offsets of the
+// sentences in IDs (one more than the number of sentences). If ids is too
+// small nothing is written and the last offset tells the size needed; pass
+// a larger buffer to copyLastTokenIds on the same thread to get the IDs.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_convertTextToTokenIdsDirect(JNIEnv *env, jobject thiz,
+                                                              jstring text, jstring voice,
+                                                              jobject ids)
+{
+    if (env->GetDirectBufferAddress(ids) == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "ids must be a direct ByteBuffer");
+        return nullptr;
+    }
+
+    const char *p_text = env->GetStringUTFChars(text, nullptr);
+    const char *p_voice = env->GetStringUTFChars(voice, nullptr);
+    convertTextToTokenIds(std::string(p_text), std::string(p_voice), directTokens);
+    env->ReleaseStringUTFChars(voice, p_voice);
+    env->ReleaseStringUTFChars(text, p_text);
+
+    CopyTokenIds(env, ids);
+
+    jlongArray offsets = env->NewLongArray(directTokens.offsets.size());
+    env->SetLongArrayRegion(offsets, 0, directTokens.offsets.size(), directTokens.offsets.data());
+    return offsets;
+}
+
+// Copies the token IDs of the last convertTextToTokenIdsDirect call on this
+// thread into ids. Returns false if ids is still too small.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_StandaloneTTS_OfflineTts_copyLastTokenIds(JNIEnv *env, jobject thiz, jobject ids)
+{
+    return CopyTokenIds(env, ids) ? JNI_TRUE : JNI_FALSE;
+}
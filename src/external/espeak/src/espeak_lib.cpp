@@ -5,29 +5,419 @@
 // Copyright (c)  2022-2023  Xiaomi Corporation
 
 #include "espeak_lib.h"
+#include <algorithm>
+#include <cctype>
 #include <codecvt>
 #include <fstream>
 #include <map>
 #include <mutex>  // NOLINT
 #include <locale>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 
 #include "espeak-ng/speak_lib.h"
+#include "espeak_pool.h"
 #include "uni_algo.h"
 
-static std::unordered_map<char32_t, int32_t> token2id_;
+// Phonemes of one eSpeak clause, after NFD, phoneme mapping and language
+// flag removal, together with the clause terminator.
+struct ClausePhonemes {
+    std::vector<Phoneme> phonemes;
+    int terminator = 0;
+};
+using ClauseList = std::vector<ClausePhonemes>;
+
+// Clauses eSpeak read from one chunk of text: from where it started reading
+// up to one of its clause ends, which lies at a ClauseBreak.
+struct ChunkPhonemes {
+    ClauseList clauses;
+    // Where eSpeak resumed reading after the last clause, relative to the
+    // end of the break.
+    uint32_t resume = 0;
+    // Set instead for a chunk eSpeak did not end at the break, e.g. "Dr.":
+    // the chunk has to be extended to a later break.
+    bool continues = false;
+};
+
+// Concurrent cache of phonemized chunks, keyed by voice and chunk text.
+// Lookups only take a shared lock on one shard, so hits from different
+// threads proceed in parallel and never touch the eSpeak mutex. Each shard
+// evicts with the CLOCK (second chance) policy: a hit sets the entry's
+// referenced bit, and eviction skips and clears referenced entries once
+// before removing them, which keeps hits free of exclusive locking.
+class PhonemeCache {
+public:
+    PhonemeCache(size_t capacity_bytes, int num_shards)
+            : shards_(std::max(1, num_shards)),
+              shard_capacity_(capacity_bytes / shards_.size()) {}
+
+    // Lookups with record == false are not counted as hits or misses and
+    // do not mark the entry referenced.
+    std::shared_ptr<const ChunkPhonemes> Get(const std::string &key, bool record = true) {
+        auto &shard = ShardFor(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            if (record) shard.misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (record) {
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            it->second.referenced.store(true, std::memory_order_relaxed);
+        }
+        return it->second.value;
+    }
+
+    void Put(const std::string &key, std::shared_ptr<const ChunkPhonemes> value) {
+        const size_t size = EntrySize(key, *value);
+        if (size > shard_capacity_) {
+            return;
+        }
+        auto &shard = ShardFor(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto inserted = shard.entries.try_emplace(key);
+        if (!inserted.second) {
+            // another thread phonemized the same clause concurrently
+            return;
+        }
+        inserted.first->second.value = std::move(value);
+        inserted.first->second.size = size;
+        shard.clock.push_back(&inserted.first->first);
+        shard.bytes += size;
+
+        while (shard.bytes > shard_capacity_) {
+            const std::string *victim_key = shard.clock.front();
+            shard.clock.pop_front();
+            auto victim = shard.entries.find(*victim_key);
+            if (victim->second.referenced.exchange(false, std::memory_order_relaxed)) {
+                shard.clock.push_back(victim_key);
+                continue;
+            }
+            shard.bytes -= victim->second.size;
+            shard.entries.erase(victim);
+            ++shard.evictions;
+        }
+    }
+
+    PhonemeCacheStats Stats() const {
+        PhonemeCacheStats stats;
+        for (const auto &shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            stats.hits += shard.hits.load(std::memory_order_relaxed);
+            stats.misses += shard.misses.load(std::memory_order_relaxed);
+            stats.evictions += shard.evictions;
+            stats.entries += shard.entries.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+    void ResetStats() {
+        for (auto &shard : shards_) {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.hits = 0;
+            shard.misses = 0;
+            shard.evictions = 0;
+        }
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const ChunkPhonemes> value;
+        size_t size = 0;
+        std::atomic<bool> referenced{false};
+    };
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        // Keys in insertion order; they point into the map nodes, which
+        // never move.
+        std::deque<const std::string *> clock;
+        size_t bytes = 0;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        uint64_t evictions = 0;
+    };
+
+    // Approximate per-entry and per-clause bookkeeping on top of the data.
+    static constexpr size_t kEntryOverhead = 128;
+    static constexpr size_t kClauseOverhead = 32;
+
+    static size_t EntrySize(const std::string &key, const ChunkPhonemes &chunk) {
+        size_t size = key.size() + kEntryOverhead;
+        for (const auto &c : chunk.clauses) {
+            size += c.phonemes.size() * sizeof(Phoneme) + kClauseOverhead;
+        }
+        return size;
+    }
+
+    Shard &ShardFor(const std::string &key) {
+        return shards_[std::hash<std::string>()(key) % shards_.size()];
+    }
+
+    std::vector<Shard> shards_;
+    const size_t shard_capacity_;
+};
+
+// What conversions use. initEspeakLib() and startEspeakProcessPool() replace
+// parts of it under state_mutex_, while every request works on its own
+// snapshot, so whatever it started with stays alive until it returns.
+struct LibState {
+    std::shared_ptr<const TokenTable> token2id = std::make_shared<TokenTable>();
+    std::shared_ptr<PhonemeCache> phoneme_cache;
+    std::shared_ptr<EspeakProcessPool> process_pool;
+    std::string data_dir;
+};
+static std::shared_mutex state_mutex_;
+static LibState state_;
+
+static LibState StateSnapshot() {
+    std::shared_lock<std::shared_mutex> lock(state_mutex_);
+    return state_;
+}
+
+static void InitEspeak(const std::string &data_dir);
+static void PreloadPhonemeCache(const LibState &state, const std::string &list_path,
+                                const std::string &default_voice);
+static TokenTable ReadTokens(std::istream &is);
+
+// Phonemizes text using espeak-ng.
+// Returns phonemes for each sentence as a separate std::vector.
+//
+// Assumes espeak_Initialize has already been called.
+static void phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
+                             const LibState &state,
+                             std::vector<std::vector<Phoneme>> &phonemes);
+
+// Statistics of all phonemizer requests, see PhonemizerStats.
+struct PhonemizerRecorders {
+    LatencyRecorder total;
+    LatencyRecorder lock_wait;
+    LatencyRecorder espeak;
+    LatencyRecorder workers;
+    LatencyRecorder mapping;
+    LatencyRecorder ids;
+    StatCounter requests;
+    StatCounter input_bytes;
+    StatCounter chunks;
+    StatCounter cached_chunks;
+    StatCounter clauses;
+    StatCounter sentences;
+    StatCounter ids_out;
+};
+static PhonemizerRecorders phonemizer_stats_;
+static SlowTraceLog<PhonemizerTrace> phonemizer_slow_traces_(0, 0);
+
+// Costs of the request this thread is working on. Its strings stay empty;
+// they are only filled in copies handed out as traces.
+static PhonemizerTrace &RequestCost() {
+    thread_local PhonemizerTrace cost;
+    return cost;
+}
+
+// True while this thread phonemizes text that is not traffic (the preload
+// list); its costs are then kept out of the statistics and slow traces.
+static bool &StatsSuppressed() {
+    thread_local bool suppressed = false;
+    return suppressed;
+}
+
+class ScopedStatsSuppression {
+public:
+    ScopedStatsSuppression() : previous_(StatsSuppressed()) { StatsSuppressed() = true; }
+    ~ScopedStatsSuppression() { StatsSuppressed() = previous_; }
+
+    ScopedStatsSuppression(const ScopedStatsSuppression &) = delete;
+    ScopedStatsSuppression &operator=(const ScopedStatsSuppression &) = delete;
+
+private:
+    bool previous_;
+};
+
+// Records the costs collected in RequestCost() for one request.
+static void RecordRequest(const std::string &text, const std::string &voice,
+                          PhonemizerTrace *trace) {
+    if (StatsSuppressed()) {
+        return;
+    }
+    const PhonemizerTrace &cost = RequestCost();
+    PhonemizerRecorders &stats = phonemizer_stats_;
+    stats.total.Record(cost.total_ns);
+    stats.ids.Record(cost.ids_ns);
+    if (cost.cached_chunks < cost.chunks) {
+        // something was phonemized
+        stats.mapping.Record(cost.mapping_ns);
+    }
+    stats.requests.Add(1);
+    stats.input_bytes.Add(text.size());
+    stats.chunks.Add(cost.chunks);
+    stats.cached_chunks.Add(cost.cached_chunks);
+    stats.clauses.Add(cost.clauses);
+    stats.sentences.Add(cost.sentences);
+    stats.ids_out.Add(cost.ids_out);
+
+    const bool slow = phonemizer_slow_traces_.IsSlow(cost.total_ns);
+    if (!trace && !slow) {
+        return;
+    }
+    PhonemizerTrace record = cost;
+    record.voice = voice;
+    record.input = text;
+    if (slow) {
+        phonemizer_slow_traces_.Add(record);
+    }
+    if (trace) {
+        *trace = std::move(record);
+    }
+}
 
 void initEspeakLib(
-        const std::string &tokens, const std::string &data_dir) {
+        const std::string &tokens, const std::string &data_dir,
+        const PhonemeCacheConfig &cache_config) {
+    InitEspeak(data_dir);
+
+    // The new tables are complete, cache preloaded, before they are
+    // published.
+    LibState state = StateSnapshot();
     {
         std::ifstream is(tokens);
-        token2id_ = ReadTokens(is);
+        state.token2id = std::make_shared<const TokenTable>(ReadTokens(is));
     }
-    InitEspeak(data_dir);
+    state.phoneme_cache.reset();
+    if (cache_config.capacity_bytes > 0) {
+        state.phoneme_cache = std::make_shared<PhonemeCache>(
+                cache_config.capacity_bytes, cache_config.shards);
+        if (!cache_config.preload_list.empty()) {
+            PreloadPhonemeCache(state, cache_config.preload_list, cache_config.preload_voice);
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(state_mutex_);
+    state_.token2id = std::move(state.token2id);
+    state_.phoneme_cache = std::move(state.phoneme_cache);
+    state_.data_dir = data_dir;
+}
+
+bool startEspeakProcessPool(const std::string &worker_path, int num_workers) {
+    std::shared_ptr<EspeakProcessPool> pool;
+    if (num_workers > 0) {
+        pool = std::make_shared<EspeakProcessPool>(worker_path, StateSnapshot().data_dir,
+                                                   num_workers);
+        if (!pool->Ok()) {
+            ESPEAK_LOGE("Failed to start eSpeak worker processes: %s", worker_path.c_str());
+            pool.reset();
+        }
+    }
+    const bool ok = num_workers <= 0 || pool != nullptr;
+    {
+        std::unique_lock<std::shared_mutex> lock(state_mutex_);
+        std::swap(state_.process_pool, pool);
+    }
+    // The replaced pool, if any, stops once the last request using it ends.
+    return ok;
+}
+
+void stopEspeakProcessPool() {
+    std::shared_ptr<EspeakProcessPool> pool;
+    std::unique_lock<std::shared_mutex> lock(state_mutex_);
+    std::swap(state_.process_pool, pool);
+}
+
+PhonemeCacheStats getPhonemeCacheStats() {
+    const LibState state = StateSnapshot();
+    return state.phoneme_cache ? state.phoneme_cache->Stats() : PhonemeCacheStats();
+}
+
+void resetPhonemeCacheStats() {
+    const LibState state = StateSnapshot();
+    if (state.phoneme_cache) state.phoneme_cache->ResetStats();
+}
+
+PhonemizerStats getPhonemizerStats() {
+    const PhonemizerRecorders &recorders = phonemizer_stats_;
+    PhonemizerStats stats;
+    stats.total = recorders.total.Snapshot();
+    stats.lock_wait = recorders.lock_wait.Snapshot();
+    stats.espeak = recorders.espeak.Snapshot();
+    stats.workers = recorders.workers.Snapshot();
+    stats.mapping = recorders.mapping.Snapshot();
+    stats.ids = recorders.ids.Snapshot();
+    stats.requests = recorders.requests.Sum();
+    stats.input_bytes = recorders.input_bytes.Sum();
+    stats.chunks = recorders.chunks.Sum();
+    stats.cached_chunks = recorders.cached_chunks.Sum();
+    stats.clauses = recorders.clauses.Sum();
+    stats.sentences = recorders.sentences.Sum();
+    stats.ids_out = recorders.ids_out.Sum();
+    return stats;
+}
+
+void resetPhonemizerStats() {
+    PhonemizerRecorders &recorders = phonemizer_stats_;
+    for (LatencyRecorder *recorder : {&recorders.total, &recorders.lock_wait,
+                                      &recorders.espeak, &recorders.workers,
+                                      &recorders.mapping, &recorders.ids}) {
+        recorder->Reset();
+    }
+    for (StatCounter *counter : {&recorders.requests, &recorders.input_bytes,
+                                 &recorders.chunks, &recorders.cached_chunks,
+                                 &recorders.clauses, &recorders.sentences,
+                                 &recorders.ids_out}) {
+        counter->Reset();
+    }
+    phonemizer_slow_traces_.Clear();
+}
+
+void setPhonemizerSlowTraces(double threshold_ms, size_t capacity) {
+    phonemizer_slow_traces_.Configure(
+            threshold_ms > 0 ? static_cast<uint64_t>(threshold_ms * 1e6) : 0, capacity);
+}
+
+std::vector<PhonemizerTrace> getPhonemizerSlowTraces() {
+    return phonemizer_slow_traces_.Get();
+}
+
+// Each line of the list is text to phonemize, optionally prefixed by a voice
+// and a tab ("de\tGuten Tag"). Lines without a voice use default_voice. The
+// line is split into clauses as any input is, and each clause is cached.
+static void PreloadPhonemeCache(const LibState &state, const std::string &list_path,
+                                const std::string &default_voice) {
+    std::ifstream is(list_path);
+    if (!is) {
+        ESPEAK_LOGE("Cannot open phoneme cache preload list: %s", list_path.c_str());
+        return;
+    }
+
+    // preloading is not traffic
+    ScopedStatsSuppression suppress_stats;
+    std::string line;
+    std::vector<std::vector<Phoneme>> phonemes;
+    while (std::getline(is, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        eSpeakPhonemeConfig config;
+        config.voice = default_voice;
+        auto tab = line.find('\t');
+        if (tab != std::string::npos) {
+            config.voice = line.substr(0, tab);
+            line.erase(0, tab + 1);
+        }
+        phonemes.clear();
+        phonemize_eSpeak(line, config, state, phonemes);
+    }
+    // The cache is not published yet, so its counters only hold the preload.
+    state.phoneme_cache->ResetStats();
 }
 
 static void InitEspeak(const std::string &data_dir) {
@@ -45,7 +435,7 @@ static void InitEspeak(const std::string &data_dir) {
     });
 }
 
-static std::unordered_map<char32_t, int32_t> ReadTokens(std::istream &is) {
+static TokenTable ReadTokens(std::istream &is) {
     std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
     std::unordered_map<char32_t, int32_t> token2id;
 
@@ -94,64 +484,101 @@ static std::unordered_map<char32_t, int32_t> ReadTokens(std::istream &is) {
 
         token2id.insert({c, id});
     }
-    return token2id;
+
+    // IPA symbols are all in the BMP; anything beyond goes to the sparse map.
+    constexpr char32_t kDenseLimit = 0x10000;
+    TokenTable table;
+    char32_t maxDense = 0;
+    for (const auto &entry : token2id) {
+        if (entry.first < kDenseLimit) maxDense = std::max(maxDense, entry.first);
+    }
+    table.dense.assign(token2id.empty() ? 0 : maxDense + 1, -1);
+    for (const auto &entry : token2id) {
+        if (entry.first < kDenseLimit) {
+            table.dense[entry.first] = entry.second;
+        } else {
+            table.sparse.insert(entry);
+        }
+    }
+    table.pad = table.Find(U'_');
+    table.bos = table.Find(U'^');
+    table.eos = table.Find(U'$');
+    return table;
 }
 
+// Phonemizes text like phonemize_eSpeak, but hands every sentence to sink
+// (Begin(), Add() for each phoneme, End()) instead of collecting vectors.
+template <class Sink>
+static void PhonemizeSentences(const std::string &text, const eSpeakPhonemeConfig &config,
+                               const LibState &state, Sink &sink);
+
 // see the function "phonemes_to_ids" from
 // https://github.com/rhasspy/piper/blob/master/notebooks/piper_inference_(ONNX).ipynb
-static std::vector<int64_t> PiperPhonemesToIds(
-        const std::unordered_map<char32_t, int32_t> &token2id,
-        const std::vector<Phoneme> &phonemes) {
-    // see
-    // https://github.com/rhasspy/piper-phonemize/blob/master/src/phoneme_ids.hpp#L17
-    int32_t pad = token2id.at(U'_');
-    int32_t bos = token2id.at(U'^');
-    int32_t eos = token2id.at(U'$');
-
-    std::vector<int64_t> ans;
-    ans.reserve(phonemes.size());
-
-    ans.push_back(bos);
-    for (auto p : phonemes) {
-        if (token2id.count(p)) {
-            ans.push_back(token2id.at(p));
-            ans.push_back(pad);
+//
+// Appends the IDs of each sentence to a TokenIdBuffer: BOS, then every known
+// phoneme followed by pad, then EOS.
+class PiperIdWriter {
+public:
+    PiperIdWriter(const TokenTable &token2id, TokenIdBuffer &out)
+            : token2id_(token2id), out_(out) {
+        // see
+        // https://github.com/rhasspy/piper-phonemize/blob/master/src/phoneme_ids.hpp#L17
+        if (token2id.pad < 0 || token2id.bos < 0 || token2id.eos < 0) {
+            throw std::out_of_range("tokens lack the pad, BOS or EOS symbol");
+        }
+    }
+
+    void Begin() { out_.ids.push_back(token2id_.bos); }
+
+    void Add(Phoneme p) {
+        int32_t id = token2id_.Find(p);
+        if (id >= 0) {
+            out_.ids.push_back(id);
+            out_.ids.push_back(token2id_.pad);
         } else {
             ESPEAK_LOGE("Skip unknown phonemes. Unicode codepoint: \\U+%04x.",
                              static_cast<uint32_t>(p));
         }
     }
-    ans.push_back(eos);
 
-    return ans;
-}
+    void End() {
+        out_.ids.push_back(token2id_.eos);
+        out_.offsets.push_back(out_.ids.size());
+    }
 
-std::vector<std::vector<int64_t>> convertTextToTokenIds(
-        const std::string &text, const std::string &voice /*= ""*/) {
+private:
+    const TokenTable &token2id_;
+    TokenIdBuffer &out_;
+};
+
+void convertTextToTokenIds(const std::string &text, const std::string &voice,
+                           TokenIdBuffer &out, PhonemizerTrace *trace) {
     eSpeakPhonemeConfig config;
 
     // ./bin/espeak-ng-bin --path  ./install/share/espeak-ng-data/ --voices
     // to list available voices
     config.voice = voice;  // e.g., voice is en-us
 
-    std::vector<std::vector<Phoneme>> phonemes;
+    const LibState state = StateSnapshot();
+    out.clear();
+    PiperIdWriter writer(*state.token2id, out);
+    PhonemizeSentences(text, config, state, writer);
 
-    static std::mutex espeak_mutex;
-    {
-        std::lock_guard<std::mutex> lock(espeak_mutex);
+    RequestCost().ids_out = out.ids.size();
+    RecordRequest(text, voice, trace);
+}
 
-        // keep multi threads from calling into phonemize_eSpeak
-        phonemize_eSpeak(text, config, phonemes);
-    }
+std::vector<std::vector<int64_t>> convertTextToTokenIds(
+        const std::string &text, const std::string &voice /*= ""*/) {
+    thread_local TokenIdBuffer buffer;
+    convertTextToTokenIds(text, voice, buffer);
 
     std::vector<std::vector<int64_t>> ans;
-    std::vector<int64_t> phoneme_ids;
-
-    for (const auto &p : phonemes) {
-        phoneme_ids = PiperPhonemesToIds(token2id_, p);
-        ans.push_back(std::move(phoneme_ids));
+    ans.reserve(buffer.numSentences());
+    for (size_t i = 0; i < buffer.numSentences(); ++i) {
+        ans.emplace_back(buffer.ids.begin() + buffer.offsets[i],
+                         buffer.ids.begin() + buffer.offsets[i + 1]);
     }
-
     return ans;
 }
 
@@ -159,120 +586,525 @@ std::vector<std::vector<int64_t>> convertTextToTokenIds(
 std::map<std::string, PhonemeMap> DEFAULT_PHONEME_MAP = {
         {"pt-br", {{U'c', {U'k'}}}}};
 
-static void phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
-                 std::vector<std::vector<Phoneme>> &phonemes) {
+// Shared copy of DEFAULT_PHONEME_MAP[voice], or nullptr if the voice has none.
+static std::shared_ptr<PhonemeMap> DefaultPhonemeMap(const std::string &voice) {
+    static const auto maps = []() {
+        std::map<std::string, std::shared_ptr<PhonemeMap>, std::less<>> maps;
+        for (const auto &entry : DEFAULT_PHONEME_MAP) {
+            maps.emplace(entry.first, std::make_shared<PhonemeMap>(entry.second));
+        }
+        return maps;
+    }();
+    auto it = maps.find(voice);
+    return it == maps.end() ? nullptr : it->second;
+}
+
+// A place where eSpeak may end a clause: after . ! ? , ; or : followed by
+// whitespace, or at the end of the text. Whether it does depends on the
+// clause and the word after it ("Dr. Smith", "J. R. R. Tolkien" or a period
+// before a lower case word do not end one), and is only known from where
+// eSpeak resumes reading once it has read them.
+struct ClauseBreak {
+    size_t end;        // just past the punctuation
+    size_t next;       // first character after the whitespace
+    size_t lookahead;  // end of the word that starts at next
+};
 
-    auto voice = config.voice;
-    int result = espeak_SetVoiceByName(voice.c_str());
-    if (result != 0) {
-        throw std::runtime_error("Failed to set eSpeak-ng voice");
+// Fills breaks with the possible clause ends of text, in order. The last
+// one is always the end of the text.
+static void FindClauseBreaks(const std::string &text, std::vector<ClauseBreak> &breaks) {
+    auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+    const size_t n = text.size();
+    breaks.clear();
+    for (size_t i = 0; i + 1 < n; ++i) {
+        const char c = text[i];
+        if (c != '.' && c != '!' && c != '?' && c != ',' && c != ';' && c != ':') continue;
+        if (!is_space(text[i + 1])) continue;
+        ClauseBreak b;
+        b.end = i + 1;
+        b.next = b.end;
+        while (b.next < n && is_space(text[b.next])) ++b.next;
+        b.lookahead = b.next;
+        while (b.lookahead < n && !is_space(text[b.lookahead])) ++b.lookahead;
+        breaks.push_back(b);
+        i = b.next - 1;
     }
+    breaks.push_back({n, n, n});
+}
+
+// Cache key of the chunk text[start, b.end): the voice, the chunk and the
+// word after it.
+static void ChunkKey(const std::string &voice, const std::string &text, size_t start,
+                     const ClauseBreak &b, std::string &key) {
+    key.assign(voice);
+    key.push_back('\0');
+    key.append(text, start, b.end - start);
+    key.push_back('\0');
+    key.append(text, b.end, b.lookahead - b.end);
+}
 
-    std::shared_ptr<PhonemeMap> phonemeMap;
-    if (config.phonemeMap) {
-        phonemeMap = config.phonemeMap;
-    } else if (DEFAULT_PHONEME_MAP.count(voice) > 0) {
-        phonemeMap = std::make_shared<PhonemeMap>(DEFAULT_PHONEME_MAP[voice]);
+static const std::shared_ptr<const ChunkPhonemes> &ContinuesMarker() {
+    static const auto marker = []() {
+        auto chunk = std::make_shared<ChunkPhonemes>();
+        chunk->continues = true;
+        return std::shared_ptr<const ChunkPhonemes>(std::move(chunk));
+    }();
+    return marker;
+}
+
+// Runs eSpeak over text and returns the raw IPA and terminator of each
+// clause, with where it resumed reading after it. Only one thread at a time
+// may call into eSpeak.
+RawClauses EspeakClauses(const std::string &text, const std::string &voice) {
+    static std::mutex espeak_mutex;
+    static std::string current_voice;
+    const uint64_t wait_start = StatsNowNs();
+    std::lock_guard<std::mutex> lock(espeak_mutex);
+    const uint64_t locked_at = StatsNowNs();
+
+    if (voice != current_voice) {
+        int result = espeak_SetVoiceByName(voice.c_str());
+        if (result != 0) {
+            current_voice.clear();
+            throw std::runtime_error("Failed to set eSpeak-ng voice");
+        }
+        current_voice = voice;
     }
 
+    RawClauses clauses;
+
     // Modified by eSpeak
     std::string textCopy(text);
 
-    std::vector<Phoneme> *sentencePhonemes = nullptr;
     const char *inputTextPointer = textCopy.c_str();
     int terminator = 0;
 
     while (inputTextPointer != NULL) {
         // Modified espeak-ng API to get access to clause terminator
-        std::string clausePhonemes(espeak_TextToPhonemesWithTerminator(
+        RawClause clause;
+        clause.ipa = espeak_TextToPhonemesWithTerminator(
                 (const void **)&inputTextPointer,
                 /*textmode*/ espeakCHARS_AUTO,
-                /*phonememode = IPA*/ 0x02, &terminator));
+                /*phonememode = IPA*/ 0x02, &terminator);
+        clause.terminator = terminator;
+        clause.next = inputTextPointer ? inputTextPointer - textCopy.c_str() : text.size();
+        clauses.push_back(std::move(clause));
+    }
+
+    const uint64_t lock_wait_ns = locked_at - wait_start;
+    const uint64_t espeak_ns = StatsNowNs() - locked_at;
+    if (!StatsSuppressed()) {
+        phonemizer_stats_.lock_wait.Record(lock_wait_ns);
+        phonemizer_stats_.espeak.Record(espeak_ns);
+    }
+    PhonemizerTrace &cost = RequestCost();
+    cost.lock_wait_ns += lock_wait_ns;
+    cost.espeak_ns += espeak_ns;
+    return clauses;
+}
+
+// NFD, phoneme map and language flag filter for the clauses [first, last).
+static std::shared_ptr<ChunkPhonemes> MapClauses(
+        RawClauses::const_iterator first, RawClauses::const_iterator last,
+        const eSpeakPhonemeConfig &config,
+        const std::shared_ptr<PhonemeMap> &phonemeMap) {
+    auto chunk = std::make_shared<ChunkPhonemes>();
+    ClauseList &clauses = chunk->clauses;
+    clauses.reserve(last - first);
+
+    for (auto espeakClause = first; espeakClause != last; ++espeakClause) {
+        clauses.emplace_back();
+        ClausePhonemes &clause = clauses.back();
+        clause.terminator = espeakClause->terminator;
+
+        // Filter out (lang) switch (flags) unless asked to keep them.
+        // These surround words from languages other than the current voice.
+        bool inLanguageFlag = false;
+        auto add = [&](Phoneme phoneme) {
+            if (config.keepLanguageFlags) {
+                clause.phonemes.push_back(phoneme);
+            } else if (inLanguageFlag) {
+                if (phoneme == U')') {
+                    // End of (lang) switch
+                    inLanguageFlag = false;
+                }
+            } else if (phoneme == U'(') {
+                // Start of (lang) switch
+                inLanguageFlag = true;
+            } else {
+                clause.phonemes.push_back(phoneme);
+            }
+        };
 
         // Decompose, e.g. "ç" -> "c" + "̧"
-        auto phonemesNorm = una::norm::to_nfd_utf8(clausePhonemes);
-        auto phonemesRange = una::ranges::utf8_view{phonemesNorm};
-
-        if (!sentencePhonemes) {
-            // Start new sentence
-            phonemes.emplace_back();
-            sentencePhonemes = &phonemes[phonemes.size() - 1];
-        }
-
-        // Maybe use phoneme map
-        std::vector<Phoneme> mappedSentPhonemes;
-        if (phonemeMap) {
-            for (auto phoneme : phonemesRange) {
-                if (phonemeMap->count(phoneme) < 1) {
-                    // No mapping for phoneme
-                    mappedSentPhonemes.push_back(phoneme);
-                } else {
-                    // Mapping for phoneme
-                    auto mappedPhonemes = &(phonemeMap->at(phoneme));
-                    mappedSentPhonemes.insert(mappedSentPhonemes.end(),
-                                              mappedPhonemes->begin(),
-                                              mappedPhonemes->end());
+        auto phonemesNorm = una::norm::to_nfd_utf8(espeakClause->ipa);
+        clause.phonemes.reserve(phonemesNorm.size());
+        for (auto phoneme : una::ranges::utf8_view{phonemesNorm}) {
+            // Maybe use phoneme map
+            if (phonemeMap) {
+                auto mapped = phonemeMap->find(phoneme);
+                if (mapped != phonemeMap->end()) {
+                    for (auto p : mapped->second) add(p);
+                    continue;
                 }
             }
-        } else {
-            // No phoneme map
-            mappedSentPhonemes.insert(mappedSentPhonemes.end(), phonemesRange.begin(),
-                                      phonemesRange.end());
+            add(phoneme);
         }
+    }
+    return chunk;
+}
 
-        auto phonemeIter = mappedSentPhonemes.begin();
-        auto phonemeEnd = mappedSentPhonemes.end();
+// Text from start up to breaks[last] (and the word after it) that is sent
+// to a worker process, with the clauses it returned.
+struct WorkerSpan {
+    size_t start;
+    size_t first;
+    size_t last;
+    RawClauses raw;
+};
 
-        if (config.keepLanguageFlags) {
-            // No phoneme filter
-            sentencePhonemes->insert(sentencePhonemes->end(), phonemeIter,
-                                     phonemeEnd);
-        } else {
-            // Filter out (lang) switch (flags).
-            // These surround words from languages other than the current voice.
-            bool inLanguageFlag = false;
-
-            while (phonemeIter != phonemeEnd) {
-                if (inLanguageFlag) {
-                    if (*phonemeIter == U')') {
-                        // End of (lang) switch
-                        inLanguageFlag = false;
-                    }
-                } else if (*phonemeIter == U'(') {
-                    // Start of (lang) switch
-                    inLanguageFlag = true;
-                } else {
-                    sentencePhonemes->push_back(*phonemeIter);
-                }
+// Scratch space of PhonemizeSentences, reused by each thread across calls.
+struct PhonemizeScratch {
+    std::vector<ClauseBreak> breaks;
+    std::string key;
+    std::string span;
+    std::vector<std::shared_ptr<const ChunkPhonemes>> chunks;
+    // Worker process path: breaks eSpeak read past, and the spans of the
+    // last round.
+    std::vector<bool> joined;
+    std::vector<WorkerSpan> spans;
+};
+
+static PhonemizeScratch &ThreadScratch() {
+    thread_local PhonemizeScratch scratch;
+    return scratch;
+}
 
-                phonemeIter++;
+// Cuts the clauses eSpeak read from text[start, ...) (raw, with offsets
+// relative to start) into chunks at those of breaks[first] to breaks[last]
+// where it ended one, maps them and appends them to scratch.chunks. Clauses
+// after breaks[last] only served to read the word after it and are dropped.
+// With a cache, the chunks are put into it, together with markers for the
+// breaks eSpeak read past. Returns false if eSpeak ended no clause at those
+// breaks, otherwise sets resume to where it resumed after the last chunk.
+static bool CutChunks(const std::string &text, size_t start, const RawClauses &raw,
+                      size_t first, size_t last, const eSpeakPhonemeConfig &config,
+                      const std::shared_ptr<PhonemeMap> &phonemeMap, PhonemeCache *cache,
+                      PhonemizeScratch &scratch, size_t *resume) {
+    const std::vector<ClauseBreak> &breaks = scratch.breaks;
+    PhonemizerTrace &cost = RequestCost();
+    const uint64_t mapping_start = StatsNowNs();
+    bool cut = false;
+    size_t chunk_start = start;
+    size_t chunk_first = 0;
+    size_t b = first;
+    for (size_t k = 0; k < raw.size() && b <= last; ++k) {
+        const size_t q = start + raw[k].next;
+        for (; b <= last && q > breaks[b].next; ++b) {
+            if (cache) {
+                ChunkKey(config.voice, text, chunk_start, breaks[b], scratch.key);
+                cache->Put(scratch.key, ContinuesMarker());
             }
         }
+        if (b > last || q < breaks[b].end) continue;
 
-        // Add appropriate punctuation depending on terminator type
-        int punctuation = terminator & 0x000FFFFF;
-        if (punctuation == CLAUSE_PERIOD) {
-            sentencePhonemes->push_back(config.period);
-        } else if (punctuation == CLAUSE_QUESTION) {
-            sentencePhonemes->push_back(config.question);
-        } else if (punctuation == CLAUSE_EXCLAMATION) {
-            sentencePhonemes->push_back(config.exclamation);
-        } else if (punctuation == CLAUSE_COMMA) {
-            sentencePhonemes->push_back(config.comma);
-            sentencePhonemes->push_back(config.space);
-        } else if (punctuation == CLAUSE_COLON) {
-            sentencePhonemes->push_back(config.colon);
-            sentencePhonemes->push_back(config.space);
-        } else if (punctuation == CLAUSE_SEMICOLON) {
-            sentencePhonemes->push_back(config.semicolon);
-            sentencePhonemes->push_back(config.space);
+        auto chunk = MapClauses(raw.begin() + chunk_first, raw.begin() + k + 1, config,
+                                phonemeMap);
+        chunk->resume = static_cast<uint32_t>(q - breaks[b].end);
+        cost.clauses += k + 1 - chunk_first;
+        ++cost.chunks;
+        if (cache) {
+            ChunkKey(config.voice, text, chunk_start, breaks[b], scratch.key);
+            cache->Put(scratch.key, chunk);
         }
+        scratch.chunks.push_back(std::move(chunk));
+        cut = true;
+        chunk_start = q;
+        chunk_first = k + 1;
+        ++b;
+    }
+    cost.mapping_ns += StatsNowNs() - mapping_start;
+    *resume = chunk_start;
+    return cut;
+}
 
-        if ((terminator & CLAUSE_TYPE_SENTENCE) == CLAUSE_TYPE_SENTENCE) {
-            // End of sentence
-            sentencePhonemes = nullptr;
+// Spreads text from start up to breaks[last] over the worker processes, in
+// spans of about equal length that end at breaks, one per worker, each
+// assuming that eSpeak resumes reading after the whitespace of the break
+// before it. Spans are taken in order as long as they start where eSpeak did
+// resume; the rest are sent again in the next round, with a break that
+// eSpeak read past joined to the following one. Spans that are unchanged in
+// the next round are not phonemized again. Returns where eSpeak resumes
+// after the spans taken; last is moved on if eSpeak read past it.
+static size_t PhonemizeOnWorkers(const std::string &text, size_t start, size_t first,
+                                 size_t &last, const eSpeakPhonemeConfig &config,
+                                 const std::shared_ptr<PhonemeMap> &phonemeMap,
+                                 PhonemeCache *cache, EspeakProcessPool *pool,
+                                 PhonemizeScratch &scratch) {
+    const std::vector<ClauseBreak> &breaks = scratch.breaks;
+    std::vector<bool> &joined = scratch.joined;
+    PhonemizerTrace &cost = RequestCost();
+    std::vector<WorkerSpan> planned;
+    std::vector<std::string> texts;
+    std::vector<size_t> sent;
+    for (;;) {
+        // Every span is read on into the word after it, so fewer, longer
+        // spans waste less.
+        const size_t span_bytes = (breaks[last].end - start) / pool->NumWorkers() + 1;
+        planned.clear();
+        for (size_t b = first, span_start = start; b <= last && span_start < text.size();) {
+            // end at the break nearest to one share of the text
+            const size_t goal = span_start + span_bytes;
+            size_t e = b;
+            while (e < last &&
+                   (joined[e] || (breaks[e].end < goal &&
+                                  (breaks[e + 1].end <= goal ||
+                                   breaks[e + 1].end - goal < goal - breaks[e].end)))) {
+                ++e;
+            }
+            planned.push_back({span_start, b, e, {}});
+            span_start = breaks[e].next;
+            b = e + 1;
         }
 
-    } // while inputTextPointer != NULL
+        texts.clear();
+        sent.clear();
+        for (size_t k = 0; k < planned.size(); ++k) {
+            WorkerSpan &span = planned[k];
+            auto done = std::find_if(scratch.spans.begin(), scratch.spans.end(),
+                                     [&span](const WorkerSpan &old) {
+                                         return old.start == span.start && old.last == span.last;
+                                     });
+            if (done != scratch.spans.end()) {
+                span.raw = std::move(done->raw);
+                continue;
+            }
+            texts.emplace_back(text, span.start, breaks[span.last].lookahead - span.start);
+            sent.push_back(k);
+        }
+        if (!texts.empty()) {
+            const uint64_t workers_start = StatsNowNs();
+            std::vector<RawClauses> raw = pool->Phonemize(config.voice, texts);
+            const uint64_t workers_ns = StatsNowNs() - workers_start;
+            if (!StatsSuppressed()) phonemizer_stats_.workers.Record(workers_ns);
+            cost.workers_ns += workers_ns;
+            for (size_t j = 0; j < sent.size(); ++j) planned[sent[j]].raw = std::move(raw[j]);
+        }
+
+        size_t resume = start;
+        for (const WorkerSpan &span : planned) {
+            size_t next = resume;
+            if (span.start != resume) break;
+            if (!CutChunks(text, span.start, span.raw, span.first, span.last, config,
+                           phonemeMap, cache, scratch, &next)) {
+                joined[span.last] = true;
+                break;
+            }
+            resume = next;
+        }
+        const size_t first_last = planned.front().last;
+        scratch.spans.swap(planned);
+        if (resume != start) return resume;
+
+        // eSpeak read past the break of the first span, which is now joined
+        // to the next one; past the last break the span has to grow.
+        if (first_last == last) {
+            // eSpeak always ends the last clause at the end of the text
+            if (last + 1 == breaks.size()) return text.size();
+            ++last;
+        }
+    }
+}
+
+// Looks up or phonemizes the clauses of text and appends them, in order, to
+// scratch.chunks.
+//
+// Without cache or worker processes eSpeak reads the whole text at once.
+// Otherwise the text is cut where eSpeak ends a clause, so that each chunk
+// starts where eSpeak resumes reading after the previous one, as it does on
+// the whole text, and the token IDs are the same. eSpeak only reads from
+// that point on and decides where a clause ends from the clause and the
+// word after it, so a chunk is phonemized together with that word, and
+// cached under it.
+static void PhonemizeChunks(const std::string &text, const eSpeakPhonemeConfig &config,
+                            const LibState &state, PhonemizeScratch &scratch) {
+    const std::string &voice = config.voice;
+
+    std::shared_ptr<PhonemeMap> phonemeMap =
+            config.phonemeMap ? config.phonemeMap : DefaultPhonemeMap(voice);
+
+    // Cached clauses depend only on the voice as long as the default phoneme
+    // map and language flag handling are used.
+    PhonemeCache *const phoneme_cache =
+            !config.phonemeMap && !config.keepLanguageFlags ? state.phoneme_cache.get()
+                                                            : nullptr;
+    EspeakProcessPool *const process_pool = state.process_pool.get();
+
+    PhonemizerTrace &cost = RequestCost();
+    auto &chunks = scratch.chunks;
+    if (!phoneme_cache && !process_pool) {
+        RawClauses raw = EspeakClauses(text, voice);
+        const uint64_t mapping_start = StatsNowNs();
+        chunks.push_back(MapClauses(raw.begin(), raw.end(), config, phonemeMap));
+        cost.mapping_ns += StatsNowNs() - mapping_start;
+        cost.chunks += 1;
+        cost.clauses += raw.size();
+        return;
+    }
+
+    auto phonemize = [&](const std::string &span) {
+        if (!process_pool) return EspeakClauses(span, voice);
+        const uint64_t workers_start = StatsNowNs();
+        RawClauses raw = std::move(process_pool->Phonemize(voice, {span})[0]);
+        const uint64_t workers_ns = StatsNowNs() - workers_start;
+        if (!StatsSuppressed()) phonemizer_stats_.workers.Record(workers_ns);
+        cost.workers_ns += workers_ns;
+        return raw;
+    };
+
+    std::vector<ClauseBreak> &breaks = scratch.breaks;
+    FindClauseBreaks(text, breaks);
+    const size_t final_break = breaks.size() - 1;
+    if (process_pool) {
+        scratch.joined.assign(breaks.size(), false);
+        scratch.spans.clear();
+    }
+    size_t start = 0;
+    size_t first = 0;
+    do {
+        // The first break past start; eSpeak resumes at or after the end of
+        // the break that ended the previous chunk.
+        while (first < final_break && breaks[first].end <= start) ++first;
+
+        size_t last = first;
+        if (phoneme_cache) {
+            std::shared_ptr<const ChunkPhonemes> chunk;
+            for (;; ++last) {
+                ChunkKey(voice, text, start, breaks[last], scratch.key);
+                chunk = phoneme_cache->Get(scratch.key);
+                if (!chunk || !chunk->continues || last == final_break) break;
+            }
+            if (chunk && !chunk->continues) {
+                ++cost.chunks;
+                ++cost.cached_chunks;
+                start = breaks[last].end + chunk->resume;
+                chunks.push_back(std::move(chunk));
+                continue;
+            }
+            // Phonemize up to the next chunk that is cached, assuming that
+            // eSpeak resumes after the whitespace.
+            while (last < final_break) {
+                ChunkKey(voice, text, breaks[last].next, breaks[last + 1], scratch.key);
+                auto next = phoneme_cache->Get(scratch.key, /*record=*/false);
+                if (next && !next->continues) break;
+                ++last;
+            }
+        } else {
+            last = final_break;
+        }
+
+        if (process_pool && last > first) {
+            start = PhonemizeOnWorkers(text, start, first, last, config, phonemeMap,
+                                       phoneme_cache, process_pool, scratch);
+            continue;
+        }
+
+        // eSpeak may read past breaks[last] without ending a clause; then
+        // the span is extended to the next break.
+        for (;; ++last) {
+            scratch.span.assign(text, start, breaks[last].lookahead - start);
+            const RawClauses raw = phonemize(scratch.span);
+            size_t resume = start;
+            if (CutChunks(text, start, raw, first, last, config, phonemeMap, phoneme_cache,
+                          scratch, &resume)) {
+                start = resume;
+                break;
+            }
+            if (last == final_break) {
+                // eSpeak always ends the last clause at the end of the text
+                start = text.size();
+                break;
+            }
+        }
+    } while (start < text.size());
+}
+
+template <class Sink>
+static void PhonemizeSentences(const std::string &text, const eSpeakPhonemeConfig &config,
+                               const LibState &state, Sink &sink) {
+    const uint64_t start = StatsNowNs();
+    PhonemizerTrace &cost = RequestCost();
+    cost = PhonemizerTrace();
+
+    PhonemizeScratch &scratch = ThreadScratch();
+    scratch.chunks.clear();
+    PhonemizeChunks(text, config, state, scratch);
+    const uint64_t phonemized_at = StatsNowNs();
+
+    bool inSentence = false;
+
+    for (const auto &chunk : scratch.chunks) {
+        for (const auto &clause : chunk->clauses) {
+            if (!inSentence) {
+                // Start new sentence
+                sink.Begin();
+                inSentence = true;
+            }
+
+            for (auto p : clause.phonemes) sink.Add(p);
+
+            // Add appropriate punctuation depending on terminator type
+            int terminator = clause.terminator;
+            int punctuation = terminator & 0x000FFFFF;
+            if (punctuation == CLAUSE_PERIOD) {
+                sink.Add(config.period);
+            } else if (punctuation == CLAUSE_QUESTION) {
+                sink.Add(config.question);
+            } else if (punctuation == CLAUSE_EXCLAMATION) {
+                sink.Add(config.exclamation);
+            } else if (punctuation == CLAUSE_COMMA) {
+                sink.Add(config.comma);
+                sink.Add(config.space);
+            } else if (punctuation == CLAUSE_COLON) {
+                sink.Add(config.colon);
+                sink.Add(config.space);
+            } else if (punctuation == CLAUSE_SEMICOLON) {
+                sink.Add(config.semicolon);
+                sink.Add(config.space);
+            }
+
+            if ((terminator & CLAUSE_TYPE_SENTENCE) == CLAUSE_TYPE_SENTENCE) {
+                // End of sentence
+                sink.End();
+                ++cost.sentences;
+                inSentence = false;
+            }
+        }
+    }
+    if (inSentence) {
+        sink.End();
+        ++cost.sentences;
+    }
+
+    // Do not keep evicted clauses alive until the next call
+    scratch.chunks.clear();
+
+    const uint64_t end = StatsNowNs();
+    cost.ids_ns = end - phonemized_at;
+    cost.total_ns = end - start;
+}
+
+static void phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
+                             const LibState &state,
+                             std::vector<std::vector<Phoneme>> &phonemes) {
+    struct Collector {
+        std::vector<std::vector<Phoneme>> &phonemes;
+        void Begin() { phonemes.emplace_back(); }
+        void Add(Phoneme p) { phonemes.back().push_back(p); }
+        void End() {}
+    } collector{phonemes};
+
+    PhonemizeSentences(text, config, state, collector);
+    RecordRequest(text, config.voice, nullptr);
 
 } /* phonemize_eSpeak */
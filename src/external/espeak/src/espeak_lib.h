@@ -6,11 +6,18 @@
 #define STANDALONETTS_ESPEAK_LIB_H
 
 #include <stdio.h>
+#include <cstdint>
+#ifdef __ANDROID__
 #include "android/log.h"
+#endif
 #include <map>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
+#include "stage_stats.h"
+
 #define ESPEAK_LOGE(...)                                            \
   do {                                                                   \
     fprintf(stderr, "%s:%s:%d ", __FILE__, __func__,                     \
@@ -60,19 +67,158 @@ struct eSpeakPhonemeConfig {
 typedef char32_t Phoneme;
 typedef std::map<Phoneme, std::vector<Phoneme>> PhonemeMap;
 
-void initEspeakLib(const std::string &tokens, const std::string &data_dir);
+// Cache of phonemized clauses shared by all callers of convertTextToTokenIds.
+// It holds chunks of text that eSpeak itself ended at a clause, as seen from
+// the pointer espeak_TextToPhonemesWithTerminator advances, looked up by
+// voice, chunk text and the word after it (which eSpeak reads to decide
+// where a clause ends). Only misses call into eSpeak, and the token IDs are
+// the same as with the cache disabled.
+struct PhonemeCacheConfig {
+    // Memory bound of the cache. 0 disables it and phonemizes whole texts.
+    size_t capacity_bytes = 4 << 20;
+
+    // Number of independently locked cache shards.
+    int shards = 16;
+
+    // Optional file of text to phonemize at init, one entry per line,
+    // optionally prefixed by "<voice>\t". Lines without a voice use
+    // preload_voice. The cache holds whole clauses as eSpeak ends them, so an
+    // entry only produces hits for input clauses that are exactly one of its
+    // clauses and are followed by the same word (or the end of the text):
+    // list prompts and phrases as they are spoken ("Battery low.",
+    // "Turn left"), not single words of sentences.
+    std::string preload_list;
+    std::string preload_voice = "en-us";
+};
+
+struct PhonemeCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// Where the time of convertTextToTokenIds goes. total, mapping and ids are
+// per request; lock_wait and espeak are per call into the in-process eSpeak,
+// workers per round trip to the worker processes.
+struct PhonemizerStats {
+    LatencyStats total;
+    LatencyStats lock_wait;  // waiting for the eSpeak mutex
+    LatencyStats espeak;     // espeak_TextToPhonemesWithTerminator over a text
+    LatencyStats workers;    // EspeakProcessPool::Phonemize
+    LatencyStats mapping;    // NFD, phoneme map and language flag removal
+    LatencyStats ids;        // assembling sentences and token IDs
+    uint64_t requests = 0;
+    uint64_t input_bytes = 0;
+    uint64_t chunks = 0;         // clause chunks looked up in the phoneme cache
+    uint64_t cached_chunks = 0;  // ... and found there
+    uint64_t clauses = 0;        // clauses returned by eSpeak
+    uint64_t sentences = 0;
+    uint64_t ids_out = 0;        // token IDs written
+};
+
+// Costs of one convertTextToTokenIds call. Times are in nanoseconds and
+// summed over all eSpeak calls of the request.
+struct PhonemizerTrace {
+    std::string voice;
+    std::string input;
+    uint64_t total_ns = 0;
+    uint64_t lock_wait_ns = 0;
+    uint64_t espeak_ns = 0;
+    uint64_t workers_ns = 0;
+    uint64_t mapping_ns = 0;
+    uint64_t ids_ns = 0;
+    uint64_t chunks = 0;
+    uint64_t cached_chunks = 0;
+    uint64_t clauses = 0;
+    uint64_t sentences = 0;
+    uint64_t ids_out = 0;
+};
+
+// Token IDs of all sentences of a text in one contiguous buffer. Sentence i
+// is ids[offsets[i], offsets[i + 1]), so offsets has one entry more than
+// there are sentences.
+struct TokenIdBuffer {
+    std::vector<int64_t> ids;
+    std::vector<int64_t> offsets;
+
+    size_t numSentences() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    void clear() {
+        ids.clear();
+        offsets.assign(1, 0);
+    }
+};
+
+// Flat code point -> token ID table read from tokens.txt.
+struct TokenTable {
+    // ID of each code point below dense.size(), -1 if there is none.
+    std::vector<int32_t> dense;
+    // IDs of code points beyond the dense range.
+    std::unordered_map<char32_t, int32_t> sparse;
+    int32_t pad = -1;
+    int32_t bos = -1;
+    int32_t eos = -1;
+
+    int32_t Find(char32_t c) const {
+        if (c < dense.size()) return dense[c];
+        auto it = sparse.find(c);
+        return it == sparse.end() ? -1 : it->second;
+    }
+};
+
+// May be called again to switch tokens or cache; conversions running at the
+// time finish with the previous ones. The eSpeak data directory is only
+// read by the first call.
+void initEspeakLib(const std::string &tokens, const std::string &data_dir,
+                   const PhonemeCacheConfig &cache_config = PhonemeCacheConfig());
 std::vector<std::vector<int64_t>> convertTextToTokenIds(
         const std::string &text, const std::string &voice);
 
-static void InitEspeak(const std::string &data_dir);
-static std::unordered_map<char32_t, int32_t> ReadTokens(std::istream &is);
+// Same token IDs as above, written into out. out is cleared first and its
+// storage reused, so once the buffers have grown and the clauses are in the
+// phoneme cache a call does not allocate. If trace is given it receives the
+// costs of this call.
+void convertTextToTokenIds(const std::string &text, const std::string &voice,
+                           TokenIdBuffer &out, PhonemizerTrace *trace = nullptr);
+
+// Moves eSpeak into num_workers separate processes running worker_path (the
+// espeak_worker executable), so that clauses of one or more texts are
+// phonemized on several cores. Texts are then phonemized in chunks that end
+// where eSpeak ends a clause, checked as with the phoneme cache, and the
+// token IDs are unchanged. Crashed
+// or hung workers are restarted. num_workers <= 0 returns to the in-process
+// eSpeak. May be called while other threads convert text: they finish with
+// the eSpeak they started with. Linux only; returns false if the workers
+// cannot be started.
+bool startEspeakProcessPool(const std::string &worker_path, int num_workers);
+void stopEspeakProcessPool();
+
+PhonemeCacheStats getPhonemeCacheStats();
+// Resets the hit, miss and eviction counters; cached clauses are kept.
+void resetPhonemeCacheStats();
+
+PhonemizerStats getPhonemizerStats();
+// Clears the statistics and the kept slow traces.
+void resetPhonemizerStats();
+
+// Keeps a trace of the last capacity convertTextToTokenIds calls that took at
+// least threshold_ms. 0 (the default) disables it.
+void setPhonemizerSlowTraces(double threshold_ms, size_t capacity = 32);
+std::vector<PhonemizerTrace> getPhonemizerSlowTraces();
+
+// Raw IPA and clause terminator of one clause eSpeak finds in a text, and
+// the offset in the text at which it resumed reading after the clause (the
+// size of the text after the last one).
+struct RawClause {
+    std::string ipa;
+    int terminator = 0;
+    size_t next = 0;
+};
+typedef std::vector<RawClause> RawClauses;
 
-// Phonemizes text using espeak-ng.
-// Returns phonemes for each sentence as a separate std::vector.
-//
-// Assumes espeak_Initialize has already been called.
-static void phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
-                 std::vector<std::vector<Phoneme>> &phonemes);
+// Runs the in-process eSpeak over text; calls are serialized internally.
+RawClauses EspeakClauses(const std::string &text, const std::string &voice);
 
 enum TextCasing {
     CASING_IGNORE = 0,
@@ -0,0 +1,458 @@
+//
+// Multi-process eSpeak phonemizer, see espeak_pool.h.
+//
+
+#include "espeak_pool.h"
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <stdexcept>
+
+#include "espeak-ng/speak_lib.h"
+
+extern char **environ;
+
+namespace {
+
+constexpr size_t kRingBytes = 1 << 20;
+
+// Chunks larger than this are phonemized in-process; clauses never are.
+constexpr size_t kMaxChunkBytes = 64 << 10;
+
+// Requests in flight per worker. Keeps both rings far from full.
+constexpr size_t kWindow = 4;
+
+// How long a worker may take for one chunk before it is considered hung.
+constexpr auto kHungTimeout = std::chrono::seconds(30);
+
+// Number of times a chunk is retried on a fresh worker after a crash.
+constexpr int kMaxRetries = 1;
+
+// Descriptor the channel is passed on to the worker.
+constexpr int kChannelFd = 3;
+
+enum ResponseStatus : uint8_t { kResponseOk = 0, kResponseBadVoice = 1 };
+
+}  // namespace
+
+// Single-producer single-consumer byte ring of length-prefixed records. head
+// and tail only grow; the producer owns head and the consumer owns tail.
+// Process-shared semaphores count the records written and wake a producer
+// waiting for space.
+struct Ring {
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    sem_t records;
+    sem_t space;
+    char data[kRingBytes];
+};
+
+struct WorkerChannel {
+    Ring requests;
+    Ring responses;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring indices must be lock-free to be shared between processes");
+
+// Waits on sem for up to timeout_ms. Returns false on timeout.
+static bool WaitSem(sem_t *sem, int timeout_ms) {
+    timespec deadline{};
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(sem, &deadline) != 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+static void CopyIn(Ring *ring, uint64_t pos, const void *src, size_t size) {
+    const auto *bytes = static_cast<const char *>(src);
+    for (size_t i = 0; i < size; ++i) ring->data[(pos + i) % kRingBytes] = bytes[i];
+}
+
+static void CopyOut(const Ring *ring, uint64_t pos, void *dst, size_t size) {
+    auto *bytes = static_cast<char *>(dst);
+    for (size_t i = 0; i < size; ++i) bytes[i] = ring->data[(pos + i) % kRingBytes];
+}
+
+// Appends one record. alive() is polled while waiting for space; returns
+// false if it reports the other side gone.
+template <class Alive>
+static bool RingWrite(Ring *ring, const std::string &payload, Alive alive) {
+    const uint32_t size = payload.size();
+    const uint64_t need = sizeof(size) + size;
+    if (need > kRingBytes) return false;
+
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    while (kRingBytes - (head - ring->tail.load(std::memory_order_acquire)) < need) {
+        if (!WaitSem(&ring->space, 100) && !alive()) return false;
+    }
+    CopyIn(ring, head, &size, sizeof(size));
+    CopyIn(ring, head + sizeof(size), payload.data(), size);
+    ring->head.store(head + need, std::memory_order_release);
+    sem_post(&ring->records);
+    return true;
+}
+
+// Removes one record. alive() is polled every 100 ms while waiting; returns
+// false if it reports the other side gone.
+template <class Alive>
+static bool RingRead(Ring *ring, std::string *payload, Alive alive) {
+    while (!WaitSem(&ring->records, 100)) {
+        if (!alive()) return false;
+    }
+    const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t size = 0;
+    CopyOut(ring, tail, &size, sizeof(size));
+    payload->resize(size);
+    CopyOut(ring, tail + sizeof(size), &(*payload)[0], size);
+    ring->tail.store(tail + sizeof(size) + size, std::memory_order_release);
+    sem_post(&ring->space);
+    return true;
+}
+
+template <class T>
+static void Put(std::string *out, const T &value) {
+    out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <class T>
+static bool Get(const std::string &in, size_t *pos, T *value) {
+    if (*pos + sizeof(T) > in.size()) return false;
+    memcpy(value, in.data() + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+}
+
+// Request: voice '\0' text.
+// Response: status, clause count, then terminator, resume offset, size and
+// IPA per clause.
+static std::string EncodeResponse(uint8_t status, const RawClauses &clauses) {
+    std::string out;
+    Put(&out, status);
+    Put(&out, static_cast<uint32_t>(clauses.size()));
+    for (const auto &clause : clauses) {
+        Put(&out, static_cast<int32_t>(clause.terminator));
+        Put(&out, static_cast<uint32_t>(clause.next));
+        Put(&out, static_cast<uint32_t>(clause.ipa.size()));
+        out += clause.ipa;
+    }
+    return out;
+}
+
+static bool DecodeResponse(const std::string &in, uint8_t *status, RawClauses *clauses) {
+    size_t pos = 0;
+    uint32_t count = 0;
+    if (!Get(in, &pos, status) || !Get(in, &pos, &count)) return false;
+    clauses->clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t terminator = 0;
+        uint32_t next = 0;
+        uint32_t size = 0;
+        if (!Get(in, &pos, &terminator) || !Get(in, &pos, &next) || !Get(in, &pos, &size) ||
+            pos + size > in.size()) {
+            return false;
+        }
+        RawClause clause;
+        clause.ipa = in.substr(pos, size);
+        clause.terminator = terminator;
+        clause.next = next;
+        clauses->push_back(std::move(clause));
+        pos += size;
+    }
+    return true;
+}
+
+EspeakProcessPool::EspeakProcessPool(const std::string &worker_path,
+                                     const std::string &data_dir, int num_workers)
+        : worker_path_(worker_path), data_dir_(data_dir), workers_(num_workers) {
+    for (auto &worker : workers_) {
+        if (!Start(&worker)) {
+            ok_ = false;
+            return;
+        }
+        idle_.push_back(&worker);
+    }
+}
+
+EspeakProcessPool::~EspeakProcessPool() {
+    for (auto &worker : workers_) {
+        Stop(&worker);
+    }
+}
+
+bool EspeakProcessPool::Start(Worker *worker) {
+    const int fd = memfd_create("espeak-worker", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    if (ftruncate(fd, sizeof(WorkerChannel)) != 0) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, sizeof(WorkerChannel), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    auto *channel = new (map) WorkerChannel;
+    for (Ring *ring : {&channel->requests, &channel->responses}) {
+        sem_init(&ring->records, /*pshared=*/1, 0);
+        sem_init(&ring->space, /*pshared=*/1, 0);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, kChannelFd);
+    // The worker exits once it is no longer our child. PR_SET_PDEATHSIG is
+    // not used: it fires when the spawning thread exits, and workers are
+    // restarted from whichever request thread found them dead.
+    std::string parent = std::to_string(getpid());
+    char *argv[] = {const_cast<char *>(worker_path_.c_str()),
+                    const_cast<char *>(data_dir_.c_str()), &parent[0], nullptr};
+    pid_t pid = -1;
+    const int result = posix_spawn(&pid, worker_path_.c_str(), &actions, nullptr,
+                                   argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (result != 0) {
+        munmap(map, sizeof(WorkerChannel));
+        close(fd);
+        return false;
+    }
+
+    worker->pid = pid;
+    worker->fd = fd;
+    worker->channel = channel;
+    return true;
+}
+
+void EspeakProcessPool::Stop(Worker *worker) {
+    if (worker->pid > 0) {
+        kill(worker->pid, SIGKILL);
+        waitpid(worker->pid, nullptr, 0);
+        worker->pid = -1;
+    }
+    if (worker->channel) {
+        for (Ring *ring : {&worker->channel->requests, &worker->channel->responses}) {
+            sem_destroy(&ring->records);
+            sem_destroy(&ring->space);
+        }
+        munmap(worker->channel, sizeof(WorkerChannel));
+        worker->channel = nullptr;
+    }
+    if (worker->fd >= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+    }
+}
+
+bool EspeakProcessPool::Alive(Worker *worker) {
+    if (worker->pid <= 0) return false;
+    if (waitpid(worker->pid, nullptr, WNOHANG) == 0) return true;
+    // Reaped: the pid may be reused, so Stop must not signal or wait on it.
+    worker->pid = -1;
+    return false;
+}
+
+std::vector<EspeakProcessPool::Worker *> EspeakProcessPool::Checkout(size_t max_workers) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this]() { return !idle_.empty(); });
+    const size_t n = std::min(max_workers, idle_.size());
+    std::vector<Worker *> taken(idle_.end() - n, idle_.end());
+    idle_.resize(idle_.size() - n);
+    return taken;
+}
+
+void EspeakProcessPool::Checkin(const std::vector<Worker *> &workers) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.insert(idle_.end(), workers.begin(), workers.end());
+    }
+    idle_cv_.notify_all();
+}
+
+std::vector<RawClauses> EspeakProcessPool::Phonemize(
+        const std::string &voice, const std::vector<std::string> &chunks) {
+    std::vector<RawClauses> results(chunks.size());
+
+    struct Slot {
+        Worker *worker;
+        std::deque<size_t> pending;
+        std::deque<size_t> in_flight;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    std::vector<size_t> remote;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].size() > kMaxChunkBytes) {
+            results[i] = EspeakClauses(chunks[i], voice);
+        } else {
+            remote.push_back(i);
+        }
+    }
+    if (remote.empty()) {
+        return results;
+    }
+
+    std::vector<Worker *> workers = Checkout(remote.size());
+    struct CheckinGuard {
+        EspeakProcessPool *pool;
+        std::vector<Worker *> *workers;
+        ~CheckinGuard() { pool->Checkin(*workers); }
+    } guard{this, &workers};
+
+    // Consecutive chunks go to different workers, so a long text is spread
+    // over all of them; results are stored by index, which restores order.
+    std::vector<Slot> slots(workers.size());
+    for (size_t k = 0; k < workers.size(); ++k) slots[k].worker = workers[k];
+    for (size_t k = 0; k < remote.size(); ++k) {
+        slots[k % slots.size()].pending.push_back(remote[k]);
+    }
+
+    std::vector<int> retries(chunks.size(), 0);
+    auto restart = [&](Slot &slot) {
+        Stop(slot.worker);
+        ++slot.worker->restarts;
+        std::deque<size_t> unanswered;
+        unanswered.swap(slot.in_flight);
+        if (!Start(slot.worker)) {
+            throw std::runtime_error("Failed to restart eSpeak worker");
+        }
+        // Resend everything the dead worker had not answered.
+        for (auto it = unanswered.rbegin(); it != unanswered.rend(); ++it) {
+            if (++retries[*it] > kMaxRetries) {
+                throw std::runtime_error("eSpeak worker crashed on the same text repeatedly");
+            }
+            slot.pending.push_front(*it);
+        }
+    };
+
+    std::string payload;
+    // Before the workers are checked in after an error: reads and drops the
+    // answers to requests still in flight, so that the next caller does not
+    // take them for its own. A worker that cannot be drained is restarted,
+    // or left stopped for the next caller to restart.
+    auto drain = [&](Slot &slot) {
+        Worker *worker = slot.worker;
+        auto alive = [this, worker, &slot]() {
+            return Alive(worker) &&
+                   std::chrono::steady_clock::now() - slot.sent < kHungTimeout;
+        };
+        while (!slot.in_flight.empty() && worker->channel &&
+               RingRead(&worker->channel->responses, &payload, alive)) {
+            slot.in_flight.pop_front();
+        }
+        if (!slot.in_flight.empty()) {
+            Stop(worker);
+            ++worker->restarts;
+            Start(worker);
+            slot.in_flight.clear();
+        }
+    };
+
+    try {
+        size_t remaining = remote.size();
+        while (remaining > 0) {
+            for (auto &slot : slots) {
+                // A previous caller failed to restart this worker.
+                if (!slot.worker->channel) restart(slot);
+                while (slot.in_flight.size() < kWindow && !slot.pending.empty()) {
+                    const size_t i = slot.pending.front();
+                    payload = voice;
+                    payload.push_back('\0');
+                    payload += chunks[i];
+                    Worker *worker = slot.worker;
+                    if (!RingWrite(&worker->channel->requests, payload,
+                                   [this, worker]() { return Alive(worker); })) {
+                        restart(slot);
+                        continue;
+                    }
+                    if (slot.in_flight.empty()) slot.sent = std::chrono::steady_clock::now();
+                    slot.pending.pop_front();
+                    slot.in_flight.push_back(i);
+                }
+            }
+
+            for (auto &slot : slots) {
+                if (slot.in_flight.empty()) continue;
+
+                Worker *worker = slot.worker;
+                auto alive = [this, worker, &slot]() {
+                    return Alive(worker) &&
+                           std::chrono::steady_clock::now() - slot.sent < kHungTimeout;
+                };
+                uint8_t status = kResponseOk;
+                const size_t i = slot.in_flight.front();
+                if (!RingRead(&worker->channel->responses, &payload, alive) ||
+                    !DecodeResponse(payload, &status, &results[i])) {
+                    restart(slot);
+                    break;
+                }
+                if (status == kResponseBadVoice) {
+                    slot.in_flight.pop_front();
+                    throw std::runtime_error("Failed to set eSpeak-ng voice");
+                }
+                slot.in_flight.pop_front();
+                slot.sent = std::chrono::steady_clock::now();
+                --remaining;
+                break;
+            }
+        }
+    } catch (...) {
+        for (auto &slot : slots) drain(slot);
+        throw;
+    }
+    return results;
+}
+
+int RunEspeakWorker(int channel_fd, const std::string &data_dir, pid_t parent) {
+    // Do not outlive the parent: once it is gone we are reparented.
+    auto parent_alive = [parent]() { return getppid() == parent; };
+    if (!parent_alive()) return 1;
+
+    void *map = mmap(nullptr, sizeof(WorkerChannel), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, channel_fd, 0);
+    if (map == MAP_FAILED) return 1;
+    auto *channel = static_cast<WorkerChannel *>(map);
+
+    int32_t result = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0, data_dir.c_str(), 0);
+    if (result != 22050) {
+        ESPEAK_LOGE("Failed to initialize espeak-ng with data dir: %s. Return code is: %d",
+                    data_dir.c_str(), result);
+        return 1;
+    }
+
+    std::string request;
+    while (RingRead(&channel->requests, &request, parent_alive)) {
+        const size_t sep = request.find('\0');
+        const std::string voice = request.substr(0, sep);
+        const std::string text = sep == std::string::npos ? "" : request.substr(sep + 1);
+
+        std::string response;
+        try {
+            response = EncodeResponse(kResponseOk, EspeakClauses(text, voice));
+        } catch (const std::runtime_error &) {
+            response = EncodeResponse(kResponseBadVoice, {});
+        }
+        if (!RingWrite(&channel->responses, response, parent_alive)) break;
+    }
+    return 0;
+}
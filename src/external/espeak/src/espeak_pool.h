@@ -0,0 +1,78 @@
+//
+// Multi-process eSpeak phonemizer.
+//
+// eSpeak-ng keeps its state in globals, so one process can only phonemize
+// one clause at a time. EspeakProcessPool runs eSpeak in separate worker
+// processes (the espeak_worker executable), each with its own
+// espeak_Initialize. The parent talks to every worker through a pair of
+// single-producer single-consumer rings in a shared memory file: requests
+// (voice and clause text) go one way, raw IPA and clause terminators come
+// back the other. A worker that dies or stops answering is killed and
+// restarted, and its outstanding requests are sent again.
+//
+
+#ifndef STANDALONETTS_ESPEAK_POOL_H
+#define STANDALONETTS_ESPEAK_POOL_H
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "espeak_lib.h"
+
+struct WorkerChannel;
+
+class EspeakProcessPool {
+public:
+    EspeakProcessPool(const std::string &worker_path, const std::string &data_dir,
+                      int num_workers);
+    ~EspeakProcessPool();
+
+    // True if all workers were started.
+    bool Ok() const { return ok_; }
+
+    size_t NumWorkers() const { return workers_.size(); }
+
+    // Phonemizes each chunk with the given voice. Chunks are spread over the
+    // free workers and the result for chunks[i] is returned at index i.
+    // Throws std::runtime_error if the voice cannot be set or a chunk keeps
+    // crashing its worker.
+    std::vector<RawClauses> Phonemize(const std::string &voice,
+                                      const std::vector<std::string> &chunks);
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int fd = -1;
+        WorkerChannel *channel = nullptr;
+        uint64_t restarts = 0;
+    };
+
+    bool Start(Worker *worker);
+    void Stop(Worker *worker);
+    bool Alive(Worker *worker);
+
+    // Takes between 1 and max_workers idle workers, waiting for one if
+    // needed, and gives them back.
+    std::vector<Worker *> Checkout(size_t max_workers);
+    void Checkin(const std::vector<Worker *> &workers);
+
+    std::string worker_path_;
+    std::string data_dir_;
+    std::vector<Worker> workers_;
+    bool ok_ = true;
+
+    std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::vector<Worker *> idle_;
+};
+
+// Worker side: serves requests from the channel mapped from channel_fd until
+// the process parent goes away. Used by the espeak_worker executable.
+int RunEspeakWorker(int channel_fd, const std::string &data_dir, pid_t parent);
+
+#endif //STANDALONETTS_ESPEAK_POOL_H
@@ -0,0 +1,20 @@
+//
+// eSpeak worker process started by EspeakProcessPool.
+//
+// Usage: espeak_worker <espeak_data_dir> <parent_pid>
+// The shared memory channel is inherited on descriptor 3. The worker exits
+// when parent_pid is no longer its parent.
+//
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "espeak_pool.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <espeak_data_dir> <parent_pid>\n", argv[0]);
+        return 1;
+    }
+    return RunEspeakWorker(3, argv[1], static_cast<pid_t>(atol(argv[2])));
+}
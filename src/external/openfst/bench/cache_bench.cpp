@@ -0,0 +1,112 @@
+//
+// Normalization cache benchmark.
+//
+// Usage: cache_bench <far_list> [corpus_file] [num_requests]
+//
+// Replays requests drawn from corpus_file (one request per line, or a
+// built-in set of notification style strings). For each target hit rate a
+// request repeats an earlier one with that probability and is otherwise made
+// unique. The same request sequence is timed with the cache disabled and
+// enabled, and the mean and tail latency of both runs are reported with the
+// hit rate observed by the cache.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "openfst_api.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const char *kDefaultCorpus[] = {
+        "You have 3 new messages.",
+        "Battery at 15%. Connect your charger.",
+        "Meeting with Dr. Smith at 10:30 am on 17 May 2024.",
+        "Your order of $20.01 has shipped.",
+        "Turn left onto 1st St in 500 ft.",
+        "It is 72 degrees and sunny.",
+        "Alarm set for 6:45 am.",
+        "Download complete: 4.5 MB.",
+};
+
+struct Timing {
+    double mean_us;
+    double p50_us;
+    double p95_us;
+};
+
+static Timing Replay(Normalizer &normalizer, const std::vector<std::string> &requests) {
+    std::vector<double> us;
+    us.reserve(requests.size());
+    for (const auto &r : requests) {
+        auto start = Clock::now();
+        normalizer.apply(r);
+        us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    double sum = 0;
+    for (double v : us) sum += v;
+    std::sort(us.begin(), us.end());
+    return {sum / us.size(), us[us.size() / 2], us[us.size() * 95 / 100]};
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <far_list> [corpus_file] [num_requests]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> corpus;
+    if (argc > 2 && *argv[2]) {
+        std::ifstream is(argv[2]);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (!line.empty()) corpus.push_back(line);
+        }
+    } else {
+        corpus.assign(std::begin(kDefaultCorpus), std::end(kDefaultCorpus));
+    }
+    if (corpus.empty()) {
+        fprintf(stderr, "Empty corpus\n");
+        return 1;
+    }
+    size_t num_requests = argc > 3 ? atol(argv[3]) : 2000;
+
+    NormalizerConfig uncached_config;
+    uncached_config.cache_capacity_bytes = 0;
+    Normalizer uncached(argv[1], uncached_config);
+
+    printf("%8s %8s %10s %10s %10s %10s %10s %10s %8s\n", "target", "hit_rate",
+           "off_mean", "off_p50", "off_p95", "on_mean", "on_p50", "on_p95", "speedup");
+    const double targets[] = {0.0, 0.25, 0.5, 0.75, 0.9, 0.99};
+    for (double target : targets) {
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        std::vector<std::string> requests;
+        requests.reserve(num_requests);
+        for (size_t i = 0; i < num_requests; ++i) {
+            if (!requests.empty() && coin(rng) < target) {
+                std::uniform_int_distribution<size_t> pick(0, requests.size() - 1);
+                requests.push_back(requests[pick(rng)]);
+            } else {
+                requests.push_back(corpus[i % corpus.size()] + " Ref " + std::to_string(i) + ".");
+            }
+        }
+
+        Normalizer cached(argv[1]);
+        Timing off = Replay(uncached, requests);
+        Timing on = Replay(cached, requests);
+        NormalizerCacheStats stats = cached.cacheStats();
+        double hit_rate = double(stats.hits) / std::max<uint64_t>(1, stats.hits + stats.misses);
+
+        printf("%8.2f %8.3f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %8.2f\n", target,
+               hit_rate, off.mean_us, off.p50_us, off.p95_us, on.mean_us, on.p50_us,
+               on.p95_us, off.mean_us / on.mean_us);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+//
+// Streaming normalization benchmark.
+//
+// Usage: normalizer_bench <far_list> [text_file] [num_threads] [use_cache] [use_lookahead]
+//
+// Reports the grammar load time and the resident memory after loading, then
+// builds inputs of 1, 2, 4, ... sentences from text_file (or a built-in
+// paragraph) and, for each length, reports the time of a single
+// Normalizer::apply() call next to the first-segment latency and total time
+// of Normalizer::applyStreaming().
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "openfst_api.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double MsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Resident set size of this process in kB, from /proc/self/status.
+static long ResidentKb() {
+    std::ifstream is("/proc/self/status");
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return atol(line.c_str() + 6);
+        }
+    }
+    return -1;
+}
+
+static const char *kDefaultText =
+        "2788 San Tomas Expy, Santa Clara, CA 95051. 708 N 1st St, San City. "
+        "Today is 17 may 2010. Tomorrow is 10/06/2005. The total bill was "
+        "$20.01. He weights 4 1/2 lbs.";
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <far_list> [text_file] [num_threads] [use_cache] [use_lookahead]\n", argv[0]);
+        return 1;
+    }
+
+    std::string paragraph = kDefaultText;
+    if (argc > 2 && *argv[2]) {
+        std::ifstream is(argv[2]);
+        std::stringstream ss;
+        ss << is.rdbuf();
+        paragraph = ss.str();
+    }
+    NormalizerConfig config;
+    // the inputs repeat the same paragraph, which would only measure the cache
+    config.cache_capacity_bytes = 0;
+    if (argc > 3) config.num_threads = atoi(argv[3]);
+    if (argc > 4) config.use_cache = atoi(argv[4]) != 0;
+    if (argc > 5) config.use_lookahead = atoi(argv[5]) != 0;
+
+    long rss_before = ResidentKb();
+    auto load_start = Clock::now();
+    Normalizer normalizer(argv[1], config);
+    printf("load_ms %.2f\n", MsSince(load_start));
+    printf("load_rss_kb %ld\n", ResidentKb() - rss_before);
+
+    // warm up the worker pool and the page cache
+    normalizer.applyStreaming(paragraph, [](size_t, const std::string &) { return true; });
+
+    printf("%8s %8s %12s %14s %14s %12s\n", "repeats", "bytes", "apply_ms",
+           "first_seg_ms", "streaming_ms", "segments");
+    for (int repeats = 1; repeats <= 64; repeats *= 2) {
+        std::string text;
+        for (int i = 0; i < repeats; ++i) {
+            text += paragraph;
+            text += ' ';
+        }
+
+        auto start = Clock::now();
+        std::string full = normalizer.apply(text);
+        double apply_ms = MsSince(start);
+
+        double first_ms = -1;
+        start = Clock::now();
+        size_t segments = normalizer.applyStreaming(
+                text, [&](size_t index, const std::string &) {
+                    if (index == 0) first_ms = MsSince(start);
+                    return true;
+                });
+        double streaming_ms = MsSince(start);
+
+        printf("%8d %8zu %12.2f %14.2f %14.2f %12zu\n", repeats, text.size(),
+               apply_ms, first_ms, streaming_ms, segments);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+//
+// Compiled normalization grammars, see grammar_archive.h.
+//
+
+#include "grammar_archive.h"
+
+#include <fstream>
+
+#include <unistd.h>
+
+#include "fst/register.h"
+
+// Fst::Read finds the rule types of an archive through these.
+static fst::FstRegisterer<Const16Fst> Const16Fst_registerer;
+static fst::FstRegisterer<PackedFst<uint32_t, uint16_t>> PackedFst_32_16_registerer;
+static fst::FstRegisterer<PackedFst<uint32_t, uint32_t>> PackedFst_32_32_registerer;
+static fst::FstRegisterer<PackedFst<uint64_t, uint16_t>> PackedFst_64_16_registerer;
+static fst::FstRegisterer<PackedFst<uint64_t, uint32_t>> PackedFst_64_32_registerer;
+
+bool GrammarArchive::Is(const std::string &path) {
+    std::ifstream strm(path, std::ios_base::in | std::ios_base::binary);
+    int32_t magic = 0;
+    fst::ReadType(strm, &magic);
+    return strm && magic == kMagic;
+}
+
+bool GrammarArchive::Read(const std::string &path,
+                          std::vector<std::unique_ptr<fst::Fst<fst::StdArc>>> *rules,
+                          std::string *info) {
+    std::ifstream strm(path, std::ios_base::in | std::ios_base::binary);
+    int32_t magic = 0, version = 0, num_rules = 0;
+    std::string description;
+    fst::ReadType(strm, &magic);
+    fst::ReadType(strm, &version);
+    fst::ReadType(strm, &description);
+    fst::ReadType(strm, &num_rules);
+    if (!strm || magic != kMagic || version != kVersion || num_rules < 0) {
+        return false;
+    }
+
+    fst::FstReadOptions opts(path);
+    opts.mode = fst::FstReadOptions::MAP;
+    std::vector<std::unique_ptr<fst::Fst<fst::StdArc>>> loaded;
+    loaded.reserve(num_rules);
+    for (int32_t i = 0; i < num_rules; ++i) {
+        std::unique_ptr<fst::Fst<fst::StdArc>> rule(fst::Fst<fst::StdArc>::Read(strm, opts));
+        if (!rule || !IsRuleType(rule->Type())) {
+            return false;
+        }
+        loaded.push_back(std::move(rule));
+    }
+
+    for (auto &rule : loaded) {
+        rules->push_back(std::move(rule));
+    }
+    if (info) *info = std::move(description);
+    return true;
+}
+
+bool GrammarArchive::Write(const std::string &path, const std::string &info,
+                           const std::vector<const fst::Fst<fst::StdArc> *> &rules) {
+    const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream strm(tmp_path, std::ios_base::out | std::ios_base::binary);
+        if (!strm) {
+            return false;
+        }
+        fst::WriteType(strm, kMagic);
+        fst::WriteType(strm, kVersion);
+        fst::WriteType(strm, info);
+        fst::WriteType(strm, static_cast<int32_t>(rules.size()));
+
+        const fst::FstWriteOptions opts(tmp_path, /*write_header=*/true,
+                                        /*write_isymbols=*/false,
+                                        /*write_osymbols=*/false,
+                                        /*align=*/true);
+        for (const auto *rule : rules) {
+            if (!rule->Write(strm, opts)) {
+                strm.setstate(std::ios_base::failbit);
+                break;
+            }
+        }
+        if (!strm.flush()) {
+            strm.close();
+            unlink(tmp_path.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool GrammarArchive::IsRuleType(const std::string &type) {
+    return type == "const" || type == "const16" || IsPackedType(type);
+}
+
+bool GrammarArchive::IsPackedType(const std::string &type) {
+    return type == PackedFst<uint32_t, uint16_t>::Compactor::Type() ||
+           type == PackedFst<uint32_t, uint32_t>::Compactor::Type() ||
+           type == PackedFst<uint64_t, uint16_t>::Compactor::Type() ||
+           type == PackedFst<uint64_t, uint32_t>::Compactor::Type();
+}
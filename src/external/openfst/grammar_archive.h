@@ -0,0 +1,231 @@
+//
+// Compiled normalization grammars.
+//
+// grammar_compiler turns the FARs of a far list into one archive of rules
+// that are ready to compose with: arc-sorted on input labels and stored in
+// the smallest read-only representation that holds them. FST::FST accepts
+// such an archive anywhere in the far list, in place of a FAR.
+//
+
+#ifndef ANDROIDTTS_GRAMMAR_ARCHIVE_H
+#define ANDROIDTTS_GRAMMAR_ARCHIVE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "fst/compact-fst.h"
+#include "fst/const-fst.h"
+#include "fst/fst.h"
+#include "fst/util.h"
+
+// Arc compactor for transducers with small label and state ranges and few
+// distinct weights, which is what the NeMo grammars are (byte labels, a
+// handful of weights). The input label, output label, weight index and next
+// state of an arc are packed into one Element with just the bits the grammar
+// needs, and the weights are kept in a table, so that an arc takes 4 or 8
+// bytes instead of the 16 of a StdArc. Labels and states are stored plus
+// one, which leaves 0 for the kNoLabel / kNoStateId of final weights.
+template <class E>
+class PackedArcCompactor {
+public:
+    using Arc = fst::StdArc;
+    using Label = Arc::Label;
+    using StateId = Arc::StateId;
+    using Weight = Arc::Weight;
+    using Element = E;
+
+    PackedArcCompactor() = default;
+
+    // Sets up the bit widths, weight table and properties for fst. Returns
+    // false if its arcs do not fit into an Element or it has more than 2^16
+    // weights.
+    bool Init(const fst::Fst<Arc> &fst) {
+        Label max_ilabel = 0, max_olabel = 0;
+        StateId num_states = 0;
+        std::vector<float> weights;
+        for (fst::StateIterator<fst::Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+            const StateId s = siter.Value();
+            ++num_states;
+            if (fst.Final(s) != Weight::Zero()) weights.push_back(fst.Final(s).Value());
+            for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done(); aiter.Next()) {
+                const Arc &arc = aiter.Value();
+                if (arc.ilabel < 0 || arc.olabel < 0) return false;
+                max_ilabel = std::max(max_ilabel, arc.ilabel);
+                max_olabel = std::max(max_olabel, arc.olabel);
+                weights.push_back(arc.weight.Value());
+            }
+        }
+        std::sort(weights.begin(), weights.end());
+        weights.erase(std::unique(weights.begin(), weights.end()), weights.end());
+        if (weights.size() > (1u << 16)) return false;
+
+        weights_ = std::move(weights);
+        ilabel_bits_ = BitWidth(uint64_t(max_ilabel) + 1);
+        olabel_bits_ = BitWidth(uint64_t(max_olabel) + 1);
+        weight_bits_ = BitWidth(weights_.empty() ? 0 : weights_.size() - 1);
+        state_bits_ = BitWidth(uint64_t(num_states));
+        SetShifts();
+        // Kept so that a packed rule stays known to be ilabel-sorted, an
+        // acceptor and so on; matchers and ArcSort rely on it.
+        properties_ = fst.Properties(kPackedProperties, true);
+        return ilabel_bits_ + olabel_bits_ + weight_bits_ + state_bits_ <=
+               int32_t(8 * sizeof(E));
+    }
+
+    Element Compact(StateId, const Arc &arc) const {
+        const auto w = std::lower_bound(weights_.begin(), weights_.end(), arc.weight.Value());
+        return (Element(arc.ilabel + 1) << ilabel_shift_) |
+               (Element(arc.olabel + 1) << olabel_shift_) |
+               (Element(w - weights_.begin()) << weight_shift_) |
+               Element(arc.nextstate + 1);
+    }
+
+    // The weight is only looked up when flags ask for it; the matchers
+    // binary search on input labels alone.
+    Arc Expand(StateId, const Element &e, uint8_t flags = fst::kArcValueFlags) const {
+        return Arc(static_cast<Label>((e >> ilabel_shift_) & Mask(ilabel_bits_)) - 1,
+                   static_cast<Label>((e >> olabel_shift_) & Mask(olabel_bits_)) - 1,
+                   (flags & fst::kArcWeightValue)
+                           ? Weight(weights_[(e >> weight_shift_) & Mask(weight_bits_)])
+                           : Weight::One(),
+                   static_cast<StateId>(e & Mask(state_bits_)) - 1);
+    }
+
+    constexpr ssize_t Size() const { return -1; }
+
+    uint64_t Properties() const { return properties_; }
+
+    // True if fst has the properties of the rule this compactor was set up
+    // for and its labels, weights and states fit the widths and table.
+    bool Compatible(const fst::Fst<Arc> &fst) const {
+        if (fst.Properties(kPackedProperties, true) != properties_) return false;
+        for (fst::StateIterator<fst::Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+            const StateId s = siter.Value();
+            if (!Fits(uint64_t(s) + 1, state_bits_)) return false;
+            if (fst.Final(s) != Weight::Zero() && !HasWeight(fst.Final(s))) return false;
+            for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done(); aiter.Next()) {
+                const Arc &arc = aiter.Value();
+                if (arc.ilabel < 0 || arc.olabel < 0 ||
+                    !Fits(uint64_t(arc.ilabel) + 1, ilabel_bits_) ||
+                    !Fits(uint64_t(arc.olabel) + 1, olabel_bits_) ||
+                    !HasWeight(arc.weight)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static const std::string &Type() {
+        static const std::string *const type =
+                new std::string("packed" + std::to_string(8 * sizeof(E)));
+        return *type;
+    }
+
+    bool Write(std::ostream &strm) const {
+        fst::WriteType(strm, ilabel_bits_);
+        fst::WriteType(strm, olabel_bits_);
+        fst::WriteType(strm, weight_bits_);
+        fst::WriteType(strm, state_bits_);
+        fst::WriteType(strm, weights_);
+        fst::WriteType(strm, properties_);
+        return !strm.fail();
+    }
+
+    static PackedArcCompactor *Read(std::istream &strm) {
+        auto compactor = std::make_unique<PackedArcCompactor>();
+        fst::ReadType(strm, &compactor->ilabel_bits_);
+        fst::ReadType(strm, &compactor->olabel_bits_);
+        fst::ReadType(strm, &compactor->weight_bits_);
+        fst::ReadType(strm, &compactor->state_bits_);
+        fst::ReadType(strm, &compactor->weights_);
+        fst::ReadType(strm, &compactor->properties_);
+        if (strm.fail()) return nullptr;
+        compactor->SetShifts();
+        return compactor.release();
+    }
+
+private:
+    // The properties that follow from the arcs, final weights and start state
+    // stored; CompactArcFst ORs them into its own.
+    static constexpr uint64_t kPackedProperties = fst::kCopyProperties & ~fst::kError;
+
+    static int32_t BitWidth(uint64_t v) {
+        int32_t bits = 0;
+        while (v) {
+            ++bits;
+            v >>= 1;
+        }
+        return bits;
+    }
+
+    static Element Mask(int32_t bits) {
+        return bits >= int32_t(8 * sizeof(Element)) ? ~Element(0) : (Element(1) << bits) - 1;
+    }
+
+    static bool Fits(uint64_t v, int32_t bits) { return BitWidth(v) <= bits; }
+
+    bool HasWeight(const Weight &weight) const {
+        return std::binary_search(weights_.begin(), weights_.end(), weight.Value());
+    }
+
+    void SetShifts() {
+        weight_shift_ = state_bits_;
+        olabel_shift_ = weight_shift_ + weight_bits_;
+        ilabel_shift_ = olabel_shift_ + olabel_bits_;
+    }
+
+    int32_t ilabel_bits_ = 0;
+    int32_t olabel_bits_ = 0;
+    int32_t weight_bits_ = 0;
+    int32_t state_bits_ = 0;
+    int32_t ilabel_shift_ = 0;
+    int32_t olabel_shift_ = 0;
+    int32_t weight_shift_ = 0;
+    std::vector<float> weights_;
+    uint64_t properties_ = 0;
+};
+
+// Packed rule with Unsigned indexing the compacts; uint16_t when the rule has
+// fewer than 2^16 arcs and final states.
+template <class Element, class Unsigned>
+using PackedFst = fst::CompactArcFst<fst::StdArc, PackedArcCompactor<Element>, Unsigned>;
+
+// ConstFst with 16 bit arc positions, for rules with fewer than 2^16 arcs.
+using Const16Fst = fst::ConstFst<fst::StdArc, uint16_t>;
+
+// Archive file: a magic number, a version, a free form description of how
+// the rules were compiled, then the rules, each an aligned FST image in its
+// own type. Like the .constcache files the images are mmap'ed on load.
+class GrammarArchive {
+public:
+    // True if path is an archive rather than a FAR.
+    static bool Is(const std::string &path);
+
+    // Reads the rules of the archive at path, and its description if info is
+    // not null. Returns false if the file cannot be read.
+    static bool Read(const std::string &path,
+                     std::vector<std::unique_ptr<fst::Fst<fst::StdArc>>> *rules,
+                     std::string *info = nullptr);
+
+    // Writes the archive under a temporary name and renames it into place.
+    static bool Write(const std::string &path, const std::string &info,
+                      const std::vector<const fst::Fst<fst::StdArc> *> &rules);
+
+    // True for the rule types that are composed with as they are: const and
+    // the types grammar_compiler writes. Composition with packed rules needs
+    // a private Copy(true) per use, as CompactFst keeps per-FST state.
+    static bool IsRuleType(const std::string &type);
+    static bool IsPackedType(const std::string &type);
+
+private:
+    static constexpr int32_t kMagic = 0x41474e54;  // "TNGA"
+    static constexpr int32_t kVersion = 2;
+};
+
+#endif //ANDROIDTTS_GRAMMAR_ARCHIVE_H
@@ -3,7 +3,26 @@
 //
 
 #include "openfst_api.h"
-
+#include "grammar_archive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <fst/fst.h>
 #include "fst/extensions/far/farlib.h"
@@ -11,7 +30,8 @@
 #include "fst/fst.h"
 #include "fst/properties.h"
 #include "fst/const-fst.h"
-#include "fst/shortest-path.h"
+#include "fst/compose.h"
+#include "fst/matcher-fst.h"
 
 namespace fst {
     // This variable is copied from
@@ -26,31 +46,193 @@ class TextNormalizer {
 public:
 
     TextNormalizer() = default;
-    explicit TextNormalizer(std::unique_ptr<fst::StdConstFst> rule)
-            : rule_(std::move(rule)) {}
+
+    // @param rule The rule FST, of one of the GrammarArchive::IsRuleType()
+    //             types; its input labels must be sorted.
+    // @param use_lookahead True to convert the rule into an input label
+    //                      lookahead FST. Composition then only follows rule
+    //                      paths that can read the next input byte, at the
+    //                      cost of a relabeled heap copy of the rule (as a
+    //                      ConstFst, whatever the type of rule).
+    explicit TextNormalizer(std::unique_ptr<fst::Fst<fst::StdArc>> rule,
+                            bool use_lookahead = false) {
+        if (use_lookahead) {
+            lookahead_rule_ = std::make_unique<fst::StdILabelLookAheadFst>(*rule);
+        } else {
+            copy_rule_ = GrammarArchive::IsPackedType(rule->Type());
+            rule_ = std::move(rule);
+        }
+    }
 
     // @param s The input text to be normalized
     // @param remove_output_zero True to remove bytes whose value is 0 from the
     //                           output.
+    // @param cost Receives the time spent and the size of the expanded
+    //             composition.
+    // @param split_time True to also split the time into composition and
+    //                   search, which costs two clock reads per state.
 
     [[nodiscard]] std::string Normalize(const std::string &s,
-                                        bool remove_output_zero=true) const {
+                                        bool remove_output_zero,
+                                        NormalizerTrace::Stage *cost,
+                                        bool split_time) const {
+        const uint64_t start = StatsNowNs();
+
         // Step 1: Convert the input text into an FST
         fst::StdVectorFst text = StringToFst(s);
+        if (lookahead_rule_) {
+            fst::LabelLookAheadRelabeler<fst::StdArc>::Relabel(
+                    &text, *lookahead_rule_, /*relabel_input=*/false);
+        }
 
-        // Step 2: Compose the input text with the rule FST
-        fst::StdVectorFst composed_fst;
-        fst::Compose(text, *rule_, &composed_fst);
+        // Step 2: Compose the input text with the rule FST on demand. States
+        // are only expanded when the search below reaches them. Packed rules
+        // keep the state they last looked at in the FST, so every
+        // composition gets its own copy; the arcs themselves are shared.
+        std::unique_ptr<fst::Fst<fst::StdArc>> rule_copy;
+        if (copy_rule_) rule_copy.reset(rule_->Copy(/*safe=*/true));
+        fst::ComposeFst<fst::StdArc> composed(text, rule_copy ? *rule_copy : Rule());
+        const uint64_t composed_at = split_time ? StatsNowNs() : 0;
+        const uint64_t construct_ns = split_time ? composed_at - start : 0;
+        cost->compose_ns = construct_ns;
 
         // Step 3: Get the best path from the composed FST
-        fst::StdVectorFst one_best;
-        fst::ShortestPath(composed_fst, &one_best, 1);
-
-        return FstToString(one_best, remove_output_zero);
+        std::string ans = BestPath(composed, remove_output_zero, split_time, cost);
+
+        const uint64_t end = StatsNowNs();
+        cost->total_ns = end - start;
+        if (split_time) {
+            // BestPath added the state expansions to compose_ns
+            const uint64_t expand_ns = cost->compose_ns - construct_ns;
+            cost->search_ns = end - composed_at - expand_ns;
+        } else {
+            cost->compose_ns = 0;
+        }
+        cost->output_bytes = ans.size();
+        return ans;
     }
 
 private:
-    std::unique_ptr<fst::StdConstFst> rule_;
+    std::unique_ptr<fst::Fst<fst::StdArc>> rule_;
+    bool copy_rule_ = false;
+    std::unique_ptr<fst::StdILabelLookAheadFst> lookahead_rule_;
+    mutable std::once_flag weights_flag_;
+    mutable bool non_negative_weights_ = false;
+
+    const fst::Fst<fst::StdArc> &Rule() const {
+        if (lookahead_rule_) return *lookahead_rule_;
+        return *rule_;
+    }
+
+    // True if no arc or final weight of the rule is negative, in which case
+    // the best-first search may stop as soon as the best path is settled.
+    // Computed on first use so that mapped rules are not paged in at load.
+    bool NonNegativeWeights() const {
+        std::call_once(weights_flag_, [this]() {
+            // A private copy, so that a packed rule does not keep the
+            // expanded states cached.
+            std::unique_ptr<fst::Fst<fst::StdArc>> copy(Rule().Copy(/*safe=*/true));
+            const auto &rule = *copy;
+            for (fst::StateIterator<fst::Fst<fst::StdArc>> siter(rule);
+                 !siter.Done(); siter.Next()) {
+                const auto s = siter.Value();
+                if (rule.Final(s).Value() < 0) return;
+                for (fst::ArcIterator<fst::Fst<fst::StdArc>> aiter(rule, s);
+                     !aiter.Done(); aiter.Next()) {
+                    if (aiter.Value().weight.Value() < 0) return;
+                }
+            }
+            non_negative_weights_ = true;
+        });
+        return non_negative_weights_;
+    }
+
+    // Single-best search over the lazily expanded composition. States are
+    // expanded cheapest first; with non-negative weights the search stops as
+    // soon as no queued state can beat the best complete path found so far.
+    // Otherwise it keeps relaxing until the queue is empty, which is still
+    // exact as long as the rule has no negative cycles.
+    //
+    // With split_time the time spent expanding states of the composition is
+    // added to cost->compose_ns.
+    std::string BestPath(const fst::Fst<fst::StdArc> &composed,
+                         bool remove_output_zero, bool split_time,
+                         NormalizerTrace::Stage *cost) const {
+        using Arc = fst::StdArc;
+        using StateId = Arc::StateId;
+        constexpr float kInfinity = std::numeric_limits<float>::infinity();
+
+        const StateId start = composed.Start();
+        if (start == fst::kNoStateId) {
+            return "";
+        }
+        const bool stop_early = NonNegativeWeights();
+
+        struct Backpointer {
+            float distance = kInfinity;
+            StateId parent = fst::kNoStateId;
+            Arc::Label olabel = 0;
+        };
+        std::vector<Backpointer> states;
+        auto at = [&states](StateId s) -> Backpointer & {
+            if (static_cast<size_t>(s) >= states.size()) states.resize(s + 1);
+            return states[s];
+        };
+
+        using Entry = std::pair<float, StateId>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        at(start).distance = 0;
+        queue.emplace(0, start);
+
+        float best_distance = kInfinity;
+        StateId best_final = fst::kNoStateId;
+        while (!queue.empty()) {
+            const auto [d, s] = queue.top();
+            queue.pop();
+            if (d > states[s].distance) continue;  // stale entry
+            if (stop_early && d >= best_distance) break;
+
+            // The composition computes the state on first access
+            uint64_t expand_start = 0;
+            if (split_time) expand_start = StatsNowNs();
+            const float final_weight = composed.Final(s).Value();
+            fst::ArcIterator<fst::Fst<Arc>> aiter(composed, s);
+            if (split_time) cost->compose_ns += StatsNowNs() - expand_start;
+            ++cost->states;
+
+            if (final_weight != kInfinity && d + final_weight < best_distance) {
+                best_distance = d + final_weight;
+                best_final = s;
+            }
+
+            for (; !aiter.Done(); aiter.Next()) {
+                const auto &arc = aiter.Value();
+                ++cost->arcs;
+                const float nd = d + arc.weight.Value();
+                auto &next = at(arc.nextstate);
+                if (nd < next.distance) {
+                    next.distance = nd;
+                    next.parent = s;
+                    next.olabel = arc.olabel;
+                    queue.emplace(nd, arc.nextstate);
+                }
+            }
+        }
+
+        std::string ans;
+        if (best_final == fst::kNoStateId) {
+            return ans;
+        }
+        for (StateId s = best_final; s != start; s = states[s].parent) {
+            const auto olabel = states[s].olabel;
+            if (olabel != 0 || !remove_output_zero) {
+                ans.push_back(olabel);
+            }
+        }
+        std::reverse(ans.begin(), ans.end());
+        return ans;
+    }
+
     static fst::StdVectorFst StringToFst(const std::string &text) {
         using Weight = typename fst::StdArc::Weight;
         using Arc = fst::StdArc;
@@ -72,49 +254,412 @@ private:
 
         return ans;
     }
+};
 
-    static std::string FstToString(const fst::StdVectorFst &fst,
-                                   bool remove_output_zero) {
-        std::string ans;
+// Fixed-size pool of worker threads that run queued tasks in FIFO order, so
+// earlier segments of a streamed text are picked up first.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t num_threads) {
+        workers_.reserve(num_threads);
+        for (size_t i = 0; i < num_threads; ++i) {
+            workers_.emplace_back([this]() { Run(); });
+        }
+    }
 
-        using Weight = typename fst::StdArc::Weight;
-        using Arc = fst::StdArc;
-        auto s = fst.Start();
-        if (s == fst::kNoStateId) {
-            // this is an empty FST
-            return "";
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
         }
-        while (fst.Final(s) == Weight::Zero()) {
-            fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s);
-            if (aiter.Done()) {
-                // not reached final.
-                return "";
+        cv_.notify_all();
+        for (auto &w : workers_) {
+            w.join();
+        }
+    }
+
+    std::future<std::string> Submit(std::function<std::string()> task) {
+        std::packaged_task<std::string()> job(std::move(task));
+        auto result = job.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+        return result;
+    }
+
+private:
+    void Run() {
+        for (;;) {
+            std::packaged_task<std::string()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                job = std::move(tasks_.front());
+                tasks_.pop_front();
             }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::packaged_task<std::string()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
 
-            const auto &arc = aiter.Value();
-            if (arc.olabel != 0 || !remove_output_zero) {
-                ans.push_back(arc.olabel);
+// Splits text into segments that the grammars are not expected to rewrite
+// across: sentences ending in [.!?] followed by whitespace, and paragraphs
+// separated by blank lines. A period after a common abbreviation or a single
+// capital initial ("Dr.", "St.", "J.") or followed by a lower case word is
+// not treated as a boundary.
+class SentenceSplitter {
+public:
+    static void Split(const std::string &text, std::vector<std::string> *out) {
+        out->clear();
+        const size_t n = text.size();
+        size_t start = 0;
+        for (size_t i = 0; i < n; ++i) {
+            size_t end = std::string::npos;
+            const char c = text[i];
+            if (c == '.' || c == '!' || c == '?') {
+                size_t j = i + 1;
+                // keep closing quotes and brackets with the sentence
+                while (j < n && IsCloser(text[j])) ++j;
+                if (j == n || IsSpace(text[j])) {
+                    if (c != '.' || IsSentencePeriod(text, i, j)) {
+                        end = j;
+                    }
+                }
+            } else if (c == '\n') {
+                size_t j = i + 1;
+                while (j < n && text[j] != '\n' && IsSpace(text[j])) ++j;
+                if (j < n && text[j] == '\n') {
+                    end = j + 1;
+                }
             }
 
-            s = arc.nextstate;
-            if (s == fst::kNoStateId) {
-                // Transition to invalid state";
-                return "";
+            if (end != std::string::npos) {
+                AddSegment(text, start, end, out);
+                start = end;
+                i = end - 1;
             }
+        }
+        AddSegment(text, start, n, out);
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return std::isspace(static_cast<unsigned char>(c)) != 0;
+    }
 
-            aiter.Next();
-            if (!aiter.Done()) {
-                // not a linear FST
-                return "";
+    static bool IsCloser(char c) {
+        return c == '"' || c == '\'' || c == ')' || c == ']';
+    }
+
+    // @param dot Position of the '.'
+    // @param next Position right after the '.' and any closing punctuation
+    static bool IsSentencePeriod(const std::string &text, size_t dot, size_t next) {
+        static const char *const kAbbreviations[] = {
+                "Mr", "Mrs", "Ms", "Dr", "Prof", "St", "Jr", "Sr", "Mt",
+                "No", "vs", "etc", "Inc", "Ltd", "Co", "Corp", "Ave",
+                "Blvd", "Rd", "Ft", "Gen", "Gov", "Sen", "Rep", "Jan",
+                "Feb", "Mar", "Apr", "Jun", "Jul", "Aug", "Sep", "Sept",
+                "Oct", "Nov", "Dec", "approx", "dept", "est", "fig", "e.g",
+                "i.e"};
+
+        size_t word_start = dot;
+        while (word_start > 0 && !IsSpace(text[word_start - 1])) --word_start;
+        const std::string word = text.substr(word_start, dot - word_start);
+
+        if (word.size() == 1 && std::isupper(static_cast<unsigned char>(word[0]))) {
+            return false;
+        }
+        for (const char *abbr : kAbbreviations) {
+            if (word == abbr) {
+                return false;
             }
         }
-        return ans;
+
+        while (next < text.size() && IsSpace(text[next])) ++next;
+        if (next < text.size() && std::islower(static_cast<unsigned char>(text[next]))) {
+            return false;
+        }
+        return true;
+    }
+
+    static void AddSegment(const std::string &text, size_t begin, size_t end,
+                           std::vector<std::string> *out) {
+        while (begin < end && IsSpace(text[begin])) ++begin;
+        while (end > begin && IsSpace(text[end - 1])) --end;
+        if (begin < end) {
+            out->push_back(text.substr(begin, end - begin));
+        }
+    }
+};
+
+// On-disk cache of the rules in a FAR, converted to aligned ConstFst images.
+// The cache for "grammar.far" lives next to it in "grammar.far.constcache" and
+// holds a small header followed by the rules in FAR order. The header records
+// the size, modification and status change times (in ns) of the FAR the
+// rules came from; a FAR that differs in any of them, even one copied with
+// its old modification time, makes the cache stale. Each image is read
+// with FstReadOptions::MAP, so its states and arcs are mmap'ed read-only from
+// the page cache (MappedFile::MapFromFileDescriptor) instead of being parsed
+// and copied into private memory, and the pages are shared between processes.
+class ConstFstCache {
+public:
+    static std::string PathFor(const std::string &far) {
+        return far + ".constcache";
+    }
+
+    // Loads the cached rules for far. Fails if the cache is missing, was
+    // written for another version of the FAR, or is unreadable.
+    static bool Load(const std::string &far,
+                     std::vector<std::unique_ptr<fst::StdConstFst>> *rules) {
+        const std::string path = PathFor(far);
+        SourceStamp far_stamp;
+        if (!StampOf(far, &far_stamp)) {
+            return false;
+        }
+
+        std::ifstream strm(path, std::ios_base::in | std::ios_base::binary);
+        int32_t magic = 0, num_rules = 0;
+        SourceStamp cache_stamp;
+        fst::ReadType(strm, &magic);
+        fst::ReadType(strm, &cache_stamp.size);
+        fst::ReadType(strm, &cache_stamp.mtime_ns);
+        fst::ReadType(strm, &cache_stamp.ctime_ns);
+        fst::ReadType(strm, &num_rules);
+        if (!strm || magic != kMagic || num_rules < 0 || !(cache_stamp == far_stamp)) {
+            return false;
+        }
+
+        fst::FstReadOptions opts(path);
+        opts.mode = fst::FstReadOptions::MAP;
+        std::vector<std::unique_ptr<fst::StdConstFst>> loaded;
+        loaded.reserve(num_rules);
+        for (int32_t i = 0; i < num_rules; ++i) {
+            std::unique_ptr<fst::StdConstFst> rule(fst::StdConstFst::Read(strm, opts));
+            if (!rule) {
+                return false;
+            }
+            loaded.push_back(std::move(rule));
+        }
+
+        for (auto &rule : loaded) {
+            rules->push_back(std::move(rule));
+        }
+        return true;
+    }
+
+    // Writes the cache for far. The file is written under a temporary name
+    // and renamed into place so that concurrent readers never see a partial
+    // cache. Failure (e.g. a read-only directory) is not an error; the rules
+    // are then simply converted again on the next start.
+    static void Store(const std::string &far,
+                      const std::vector<const fst::StdConstFst *> &rules) {
+        const std::string path = PathFor(far);
+        const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+        SourceStamp far_stamp;
+        if (!StampOf(far, &far_stamp)) {
+            return;
+        }
+        {
+            std::ofstream strm(tmp_path, std::ios_base::out | std::ios_base::binary);
+            if (!strm) {
+                return;
+            }
+            fst::WriteType(strm, kMagic);
+            fst::WriteType(strm, far_stamp.size);
+            fst::WriteType(strm, far_stamp.mtime_ns);
+            fst::WriteType(strm, far_stamp.ctime_ns);
+            fst::WriteType(strm, static_cast<int32_t>(rules.size()));
+
+            const fst::FstWriteOptions opts(tmp_path, /*write_header=*/true,
+                                            /*write_isymbols=*/false,
+                                            /*write_osymbols=*/false,
+                                            /*align=*/true);
+            for (const auto *rule : rules) {
+                if (!rule->Write(strm, opts)) {
+                    strm.setstate(std::ios_base::failbit);
+                    break;
+                }
+            }
+            if (!strm.flush()) {
+                strm.close();
+                unlink(tmp_path.c_str());
+                return;
+            }
+        }
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+        }
+    }
+
+private:
+    // Identifies the version of a FAR the cache was written for.
+    struct SourceStamp {
+        int64_t size = -1;
+        int64_t mtime_ns = -1;
+        int64_t ctime_ns = -1;
+
+        bool operator==(const SourceStamp &other) const {
+            return size == other.size && mtime_ns == other.mtime_ns &&
+                   ctime_ns == other.ctime_ns;
+        }
+    };
+
+    static bool StampOf(const std::string &far, SourceStamp *stamp) {
+        struct stat far_stat{};
+        if (stat(far.c_str(), &far_stat) != 0) {
+            return false;
+        }
+        stamp->size = static_cast<int64_t>(far_stat.st_size);
+        stamp->mtime_ns = int64_t(far_stat.st_mtim.tv_sec) * 1000000000 + far_stat.st_mtim.tv_nsec;
+        stamp->ctime_ns = int64_t(far_stat.st_ctim.tv_sec) * 1000000000 + far_stat.st_ctim.tv_nsec;
+        return true;
+    }
+
+    // Changed from "FSTC" when the source stamp was added to the header.
+    static constexpr int32_t kMagic = 0x32545346;  // "FST2"
+};
+
+// Bounded cache of normalized strings shared by all threads using one
+// normalizer, and therefore by one grammar set. Entries are spread over
+// independently locked shards by the hash of the input, and each shard
+// evicts its least recently used entries once its share of the byte
+// capacity is exceeded.
+class NormalizationCache {
+public:
+    NormalizationCache(size_t capacity_bytes, int num_shards)
+            : shards_(std::max(1, num_shards)),
+              shard_capacity_(capacity_bytes / shards_.size()) {}
+
+    bool Get(const std::string &key, std::string *value) {
+        auto &shard = ShardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            ++shard.misses;
+            return false;
+        }
+        ++shard.hits;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        *value = it->second->second;
+        return true;
+    }
+
+    void Put(const std::string &key, const std::string &value) {
+        const size_t size = EntrySize(key, value);
+        if (size > shard_capacity_) {
+            return;
+        }
+        auto &shard = ShardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.index.count(key)) {
+            // another thread normalized the same input concurrently
+            return;
+        }
+        shard.lru.emplace_front(key, value);
+        shard.index.emplace(shard.lru.front().first, shard.lru.begin());
+        shard.bytes += size;
+        while (shard.bytes > shard_capacity_) {
+            const auto &victim = shard.lru.back();
+            shard.bytes -= EntrySize(victim.first, victim.second);
+            shard.index.erase(victim.first);
+            shard.lru.pop_back();
+            ++shard.evictions;
+        }
+    }
+
+    NormalizerCacheStats Stats() const {
+        NormalizerCacheStats stats;
+        for (const auto &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.evictions += shard.evictions;
+            stats.entries += shard.lru.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+    void ResetStats() {
+        for (auto &shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.hits = shard.misses = shard.evictions = 0;
+        }
+    }
+
+private:
+    using Entry = std::pair<std::string, std::string>;
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;  // most recently used first
+        // Keys point into the list nodes, which never move.
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Approximate per-entry bookkeeping on top of the text itself.
+    static constexpr size_t kEntryOverhead = 96;
+
+    static size_t EntrySize(const std::string &key, const std::string &value) {
+        return key.size() + value.size() + kEntryOverhead;
     }
+
+    Shard &ShardFor(const std::string &key) {
+        return shards_[std::hash<std::string>()(key) % shards_.size()];
+    }
+
+    std::vector<Shard> shards_;
+    const size_t shard_capacity_;
 };
 
 class FST {
 
+    // One in this many requests splits the stage time into composition and
+    // search.
+    static constexpr uint32_t kSplitTimeSampling = 16;
+
+    // Statistics of one grammar stage, recorded on every normalization.
+    struct StageRecorder {
+        std::string name;
+        LatencyRecorder latency;
+        LatencyRecorder compose;
+        LatencyRecorder search;
+        StatCounter calls;
+        StatCounter states;
+        StatCounter arcs;
+        StatCounter input_bytes;
+        StatCounter output_bytes;
+        StatCounter empty_outputs;
+    };
+
     std::vector<std::unique_ptr<TextNormalizer>> tn_list_;
+    std::vector<std::unique_ptr<StageRecorder>> stage_stats_;
+    size_t num_threads_;
+    std::unique_ptr<NormalizationCache> cache_;
+    LatencyRecorder total_;
+    StatCounter cache_hits_;
+    SlowTraceLog<NormalizerTrace> slow_traces_;
+    // Last, so that the workers are joined before the members their
+    // segment tasks use are destroyed: an applyStreaming() call that stopped
+    // early leaves its remaining segments running.
+    std::once_flag pool_flag_;
+    std::unique_ptr<WorkerPool> pool_;
+
     static void SplitStringToVector(const std::string &full, const char *delim,
                                     bool omit_empty_strings,
                                     std::vector<std::string> *out) {
@@ -129,12 +674,13 @@ class FST {
         }
     }
 
-    static fst::ConstFst<fst::StdArc> *CastOrConvertToConstFst(fst::Fst<fst::StdArc> *fst) {
-        // This version currently supports ConstFst<StdArc> or VectorFst<StdArc>
+    static fst::Fst<fst::StdArc> *CastOrConvertToConstFst(fst::Fst<fst::StdArc> *fst) {
+        // This version supports VectorFst<StdArc>, and the read-only types
+        // of GrammarArchive::IsRuleType(), which are used as they are.
         std::string real_type = fst->Type();
-        assert(real_type == "vector" || real_type == "const");
-        if (real_type == "const") {
-            return dynamic_cast<fst::ConstFst<fst::StdArc> *>(fst);
+        assert(real_type == "vector" || GrammarArchive::IsRuleType(real_type));
+        if (real_type != "vector") {
+            return fst;
         } else {
             // As the 'fst' can't cast to VectorFst, we create a new
             // VectorFst<StdArc> initialized by 'fst', and delete 'fst'.
@@ -145,39 +691,233 @@ class FST {
     }
 
 public:
-    explicit FST(const std::string& far_list) {
+    explicit FST(const std::string& far_list,
+                 const NormalizerConfig& config = NormalizerConfig())
+            : num_threads_(config.num_threads > 0
+                           ? config.num_threads
+                           : std::max(1u, std::thread::hardware_concurrency())),
+              slow_traces_(static_cast<uint64_t>(config.slow_trace_ms * 1e6),
+                           config.slow_trace_capacity) {
+        if (config.cache_capacity_bytes > 0) {
+            cache_ = std::make_unique<NormalizationCache>(
+                    config.cache_capacity_bytes, config.cache_shards);
+        }
+
         std::vector<std::string> files;
         SplitStringToVector(far_list, ",", false, &files);
 
         tn_list_.reserve(files.size() + tn_list_.size());
 
+        std::vector<std::unique_ptr<fst::Fst<fst::StdArc>>> rules;
+        std::vector<std::unique_ptr<fst::StdConstFst>> cached_rules;
         for (const auto &f : files) {
-            std::unique_ptr<fst::FarReader<fst::StdArc>> reader(fst::FarReader<fst::StdArc>::Open(f));
-            for (; !reader->Done(); reader->Next()) {
-                std::unique_ptr<fst::StdConstFst> r(
-                        CastOrConvertToConstFst(reader->GetFst()->Copy()));
+            rules.clear();
+            cached_rules.clear();
+            if (GrammarArchive::Is(f)) {
+                // Compiled by grammar_compiler; already mmap'able, no cache.
+                if (!GrammarArchive::Read(f, &rules)) {
+                    LOG(ERROR) << "FST: Cannot read grammar archive " << f;
+                }
+            } else if (config.use_cache && ConstFstCache::Load(f, &cached_rules)) {
+                for (auto &r : cached_rules) rules.push_back(std::move(r));
+            } else {
+                std::unique_ptr<fst::FarReader<fst::StdArc>> reader(fst::FarReader<fst::StdArc>::Open(f));
+                for (; !reader->Done(); reader->Next()) {
+                    rules.emplace_back(
+                            CastOrConvertToConstFst(reader->GetFst()->Copy()));
+                }
+                if (config.use_cache) {
+                    // Only FARs of plain ConstFst rules can be cached.
+                    std::vector<const fst::StdConstFst *> to_store;
+                    for (const auto &r : rules) {
+                        if (auto *c = dynamic_cast<const fst::StdConstFst *>(r.get())) {
+                            to_store.push_back(c);
+                        }
+                    }
+                    if (to_store.size() == rules.size()) ConstFstCache::Store(f, to_store);
+                }
+            }
 
-                tn_list_.push_back(
-                        std::make_unique<TextNormalizer>(std::move(r)));
+            for (size_t i = 0; i < rules.size(); ++i) {
+                tn_list_.push_back(std::make_unique<TextNormalizer>(
+                        std::move(rules[i]), config.use_lookahead));
+                stage_stats_.push_back(std::make_unique<StageRecorder>());
+                stage_stats_.back()->name = f + "#" + std::to_string(i);
             }
         }
     }
 
-    std::string Normalize(const std::string& text) {
-        std::string textout = text;
+    // @param trace If not null, receives the cost of each grammar stage.
+    std::string Normalize(const std::string& text, NormalizerTrace* trace = nullptr) {
+        const uint64_t start = StatsNowNs();
 
-        if (!tn_list_.empty()) {
-            for (const auto &tn : tn_list_) {
-                textout = tn->Normalize(textout);
-                // std::cout << textout << std::endl;
+        // Per stage costs of this request
+        thread_local std::vector<NormalizerTrace::Stage> costs;
+        costs.clear();
+
+        std::string textout;
+        if (cache_ && cache_->Get(text, &textout)) {
+            cache_hits_.Add(1);
+            FinishRequest(text, start, /*cache_hit=*/true, costs, trace);
+            return textout;
+        }
+        textout = text;
+
+        // Splitting composition from search time is sampled, as it needs
+        // clock reads per expanded state.
+        thread_local uint32_t requests = 0;
+        const bool split_time = trace || (++requests % kSplitTimeSampling) == 0;
+
+        costs.resize(tn_list_.size());
+        for (size_t i = 0; i < tn_list_.size(); ++i) {
+            const size_t input_bytes = textout.size();
+            textout = tn_list_[i]->Normalize(textout, true, &costs[i], split_time);
+            // std::cout << textout << std::endl;
+
+            StageRecorder &stats = *stage_stats_[i];
+            const NormalizerTrace::Stage &cost = costs[i];
+            stats.latency.Record(cost.total_ns);
+            if (split_time) {
+                stats.compose.Record(cost.compose_ns);
+                stats.search.Record(cost.search_ns);
             }
+            stats.calls.Add(1);
+            stats.states.Add(cost.states);
+            stats.arcs.Add(cost.arcs);
+            stats.input_bytes.Add(input_bytes);
+            stats.output_bytes.Add(cost.output_bytes);
+            if (cost.output_bytes == 0 && input_bytes > 0) stats.empty_outputs.Add(1);
         }
+        if (cache_) {
+            cache_->Put(text, textout);
+        }
+        FinishRequest(text, start, /*cache_hit=*/false, costs, trace);
         return textout;
     }
+
+    size_t NormalizeStreaming(const std::string& text,
+                              const Normalizer::SegmentCallback& callback) {
+        std::vector<std::string> segments;
+        SentenceSplitter::Split(text, &segments);
+        if (segments.empty()) {
+            return 0;
+        }
+
+        std::call_once(pool_flag_, [this]() {
+            pool_ = std::make_unique<WorkerPool>(num_threads_);
+        });
+
+        // Segments that are still queued when this returns, because the
+        // callback asked to stop or something threw, are skipped rather than
+        // normalized.
+        auto cancelled = std::make_shared<std::atomic<bool>>(false);
+        struct CancelOnExit {
+            std::shared_ptr<std::atomic<bool>> cancelled;
+            ~CancelOnExit() { cancelled->store(true, std::memory_order_relaxed); }
+        } cancel_on_exit{cancelled};
+        std::vector<std::future<std::string>> results;
+        results.reserve(segments.size());
+        for (auto &segment : segments) {
+            results.push_back(pool_->Submit(
+                    [this, cancelled, segment = std::move(segment)]() {
+                        if (cancelled->load(std::memory_order_relaxed)) {
+                            return std::string();
+                        }
+                        return Normalize(segment);
+                    }));
+        }
+
+        size_t delivered = 0;
+        for (auto &result : results) {
+            std::string normalized = result.get();
+            if (!callback(delivered, normalized)) {
+                return delivered + 1;
+            }
+            ++delivered;
+        }
+        return delivered;
+    }
+
+    NormalizerCacheStats CacheStats() const {
+        return cache_ ? cache_->Stats() : NormalizerCacheStats();
+    }
+
+    void ResetCacheStats() {
+        if (cache_) cache_->ResetStats();
+    }
+
+    NormalizerStats Stats() const {
+        NormalizerStats stats;
+        stats.total = total_.Snapshot();
+        stats.cache_hits = cache_hits_.Sum();
+        for (const auto &recorder : stage_stats_) {
+            NormalizerStageStats stage;
+            stage.name = recorder->name;
+            stage.latency = recorder->latency.Snapshot();
+            stage.compose = recorder->compose.Snapshot();
+            stage.search = recorder->search.Snapshot();
+            stage.calls = recorder->calls.Sum();
+            stage.states = recorder->states.Sum();
+            stage.arcs = recorder->arcs.Sum();
+            stage.input_bytes = recorder->input_bytes.Sum();
+            stage.output_bytes = recorder->output_bytes.Sum();
+            stage.empty_outputs = recorder->empty_outputs.Sum();
+            stats.stages.push_back(std::move(stage));
+        }
+        return stats;
+    }
+
+    void ResetStats() {
+        total_.Reset();
+        cache_hits_.Reset();
+        for (auto &recorder : stage_stats_) {
+            recorder->latency.Reset();
+            recorder->compose.Reset();
+            recorder->search.Reset();
+            recorder->calls.Reset();
+            recorder->states.Reset();
+            recorder->arcs.Reset();
+            recorder->input_bytes.Reset();
+            recorder->output_bytes.Reset();
+            recorder->empty_outputs.Reset();
+        }
+        slow_traces_.Clear();
+    }
+
+    std::vector<NormalizerTrace> SlowTraces() const {
+        return slow_traces_.Get();
+    }
+
+private:
+    // Records the request latency, and builds its trace if it was asked for
+    // or the request was slow.
+    void FinishRequest(const std::string& text, uint64_t start, bool cache_hit,
+                       const std::vector<NormalizerTrace::Stage>& costs,
+                       NormalizerTrace* trace) {
+        const uint64_t total_ns = StatsNowNs() - start;
+        total_.Record(total_ns);
+
+        const bool slow = slow_traces_.IsSlow(total_ns);
+        if (!trace && !slow) {
+            return;
+        }
+        NormalizerTrace record;
+        record.input = text;
+        record.total_ns = total_ns;
+        record.cache_hit = cache_hit;
+        record.stages = costs;
+        if (slow) {
+            slow_traces_.Add(record);
+        }
+        if (trace) {
+            *trace = std::move(record);
+        }
+    }
 };
 
-Normalizer::Normalizer(const std::string& far_list) {
-    pFST = new FST( far_list );
+Normalizer::Normalizer(const std::string& far_list,
+                       const NormalizerConfig& config) {
+    pFST = new FST( far_list, config );
 }
 
 Normalizer::~Normalizer(){
@@ -187,6 +927,35 @@ Normalizer::~Normalizer(){
 std::string Normalizer::apply(const std::string &text) {
     return pFST->Normalize(text);
 }
+
+std::string Normalizer::apply(const std::string &text, NormalizerTrace *trace) {
+    return pFST->Normalize(text, trace);
+}
+
+size_t Normalizer::applyStreaming(const std::string &text,
+                                  const SegmentCallback &callback) {
+    return pFST->NormalizeStreaming(text, callback);
+}
+
+NormalizerCacheStats Normalizer::cacheStats() const {
+    return pFST->CacheStats();
+}
+
+void Normalizer::resetCacheStats() {
+    pFST->ResetCacheStats();
+}
+
+NormalizerStats Normalizer::stats() const {
+    return pFST->Stats();
+}
+
+void Normalizer::resetStats() {
+    pFST->ResetStats();
+}
+
+std::vector<NormalizerTrace> Normalizer::slowTraces() const {
+    return pFST->SlowTraces();
+}
 //
 //int main( void )
 //{
@@ -4,18 +4,124 @@
 
 #ifndef ANDROIDTTS_OPENFST_API_H
 #define ANDROIDTTS_OPENFST_API_H
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <string>
 
+#include "stage_stats.h"
+
 class FST;
 
+struct NormalizerConfig {
+    // Size of the worker pool used by applyStreaming(). 0 uses the number of
+    // hardware threads.
+    int num_threads = 0;
+
+    // Memory-map the rules from a ConstFst cache written next to each FAR
+    // ("<far>.constcache"). The cache is created on first use and rebuilt
+    // when the FAR changes (in size, modification or status change time).
+    bool use_cache = true;
+
+    // Compose with input label lookahead matchers, so that rule paths which
+    // cannot read the next input byte are never expanded. Each rule is then
+    // relabeled into a private heap copy, which costs load time and memory.
+    bool use_lookahead = false;
+
+    // Upper bound, in bytes of input and output text, of the cache of
+    // normalized strings. apply() caches whole inputs and applyStreaming()
+    // caches individual segments. 0 disables the cache.
+    size_t cache_capacity_bytes = 1 << 20;
+
+    // Number of independently locked cache shards.
+    int cache_shards = 16;
+
+    // Keep a trace of the last slow_trace_capacity apply() calls, or
+    // applyStreaming() segments, that took at least slow_trace_ms.
+    // 0 disables the trace log.
+    double slow_trace_ms = 0;
+    size_t slow_trace_capacity = 32;
+};
+
+struct NormalizerCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// Per grammar stage statistics. Composition is lazy, so compose covers
+// building the ComposeFst and expanding its states on demand, and search the
+// best path search around it. Timing them separately needs a clock read per
+// state, so only one in 16 requests (and every traced one) is split.
+struct NormalizerStageStats {
+    std::string name;  // "<far file>#<index of the FST in the FAR>"
+    LatencyStats latency;
+    LatencyStats compose;  // sampled
+    LatencyStats search;   // sampled
+    uint64_t calls = 0;
+    uint64_t states = 0;        // states of the composition expanded
+    uint64_t arcs = 0;          // arcs of the composition relaxed
+    uint64_t input_bytes = 0;
+    uint64_t output_bytes = 0;
+    uint64_t empty_outputs = 0; // no path through the grammar
+};
+
+struct NormalizerStats {
+    LatencyStats total;  // apply() calls and applyStreaming() segments
+    uint64_t cache_hits = 0;
+    std::vector<NormalizerStageStats> stages;
+};
+
+// Where the time of one request went.
+struct NormalizerTrace {
+    struct Stage {
+        uint64_t total_ns = 0;
+        uint64_t compose_ns = 0;  // 0 unless the request was sampled or traced
+        uint64_t search_ns = 0;
+        uint64_t states = 0;
+        uint64_t arcs = 0;
+        uint64_t output_bytes = 0;
+    };
+    std::string input;
+    uint64_t total_ns = 0;
+    bool cache_hit = false;
+    std::vector<Stage> stages;  // in the order of NormalizerStats::stages
+};
+
 class Normalizer
 {
 private:
     FST* pFST;
 public:
-    explicit Normalizer( const std::string& far_list );
+    // Receives one normalized segment. Segments are delivered in input order
+    // on the thread that called applyStreaming(). Return false to stop early.
+    using SegmentCallback =
+            std::function<bool(size_t index, const std::string& normalized)>;
+
+    // far_list is a comma separated list of FARs, or of grammar archives
+    // written by grammar_compiler; the rules are applied in list order.
+    explicit Normalizer( const std::string& far_list,
+                         const NormalizerConfig& config = NormalizerConfig() );
     std::string apply( const std::string& text );
+    // Same as apply(), filling trace with the cost of each grammar stage.
+    std::string apply( const std::string& text, NormalizerTrace* trace );
+
+    // Splits text into sentence segments, normalizes them concurrently and
+    // calls callback for each segment as soon as it and all the segments
+    // before it are done. Returns the number of segments delivered.
+    size_t applyStreaming( const std::string& text, const SegmentCallback& callback );
+
+    NormalizerCacheStats cacheStats() const;
+    // Resets the hit, miss and eviction counters; cached entries are kept.
+    void resetCacheStats();
+
+    NormalizerStats stats() const;
+    void resetStats();
+    // Traces of recent slow requests, oldest first; see
+    // NormalizerConfig::slow_trace_ms.
+    std::vector<NormalizerTrace> slowTraces() const;
     ~Normalizer();
 };
 #endif //ANDROIDTTS_OPENFST_API_H
@@ -2,8 +2,10 @@
 #include <jni.h>
 
 #include <cinttypes>
+#include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
 #include "openfst_api.h"
 
 #define LOGI(...) \
@@ -13,9 +15,16 @@
 extern "C"
 JNIEXPORT jlong JNICALL
 Java_com_StandaloneTTS_OfflineTts_00024Normalizer_initNormalizer(JNIEnv *env, jobject thiz,
-                                                                 jstring far_list) {
+                                                                 jstring far_list,
+                                                                 jdouble slow_trace_ms,
+                                                                 jlong cache_capacity_bytes,
+                                                                 jint cache_shards) {
     const char * p_far_list = env->GetStringUTFChars(far_list, nullptr);
-    auto *pNormalizer = new Normalizer(std::string(p_far_list));
+    NormalizerConfig config;
+    config.slow_trace_ms = slow_trace_ms;
+    config.cache_capacity_bytes = cache_capacity_bytes > 0 ? static_cast<size_t>(cache_capacity_bytes) : 0;
+    config.cache_shards = cache_shards;
+    auto *pNormalizer = new Normalizer(std::string(p_far_list), config);
     env->ReleaseStringUTFChars( far_list, p_far_list);
     return (jlong) pNormalizer;
 }
@@ -35,6 +44,158 @@ Java_com_StandaloneTTS_OfflineTts_00024Normalizer_normalizeImpl(JNIEnv *env, job
     return result;
 }
 
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_normalizeStreamingImpl(JNIEnv *env, jobject thiz,
+                                                                         jlong ptr, jstring text,
+                                                                         jobject callback) {
+    const char* pText = env->GetStringUTFChars( text, nullptr );
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+
+    jclass callbackClass = env->GetObjectClass(callback);
+    jmethodID onSegment = env->GetMethodID(callbackClass, "onSegment", "(ILjava/lang/String;)Z");
+
+    // Segments are delivered on this thread, so env stays valid inside the callback.
+    size_t delivered = pNormalizer->applyStreaming(
+            std::string(pText),
+            [env, callback, onSegment](size_t index, const std::string &normalized) {
+                jstring segment = env->NewStringUTF(normalized.c_str());
+                jboolean more = env->CallBooleanMethod(callback, onSegment,
+                                                       (jint) index, segment);
+                env->DeleteLocalRef(segment);
+                return more == JNI_TRUE && !env->ExceptionCheck();
+            });
+
+    env->ReleaseStringUTFChars( text, pText );
+    return (jint) delivered;
+}
+
+// Returns {hits, misses, evictions, entries, bytes}.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_getCacheStatsImpl(JNIEnv *env, jobject thiz,
+                                                                    jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    NormalizerCacheStats stats = pNormalizer->cacheStats();
+
+    jlong values[] = {(jlong) stats.hits, (jlong) stats.misses, (jlong) stats.evictions,
+                      (jlong) stats.entries, (jlong) stats.bytes};
+    jlongArray result = env->NewLongArray(5);
+    env->SetLongArrayRegion(result, 0, 5, values);
+    return result;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_resetCacheStatsImpl(JNIEnv *env, jobject thiz,
+                                                                      jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    pNormalizer->resetCacheStats();
+}
+
+// Returns the total latency and cache hits, then the number of stages and
+// for each stage {calls, states, arcs, input bytes, output bytes, empty
+// outputs} followed by its latency, compose and search latencies. Latencies
+// are {count, mean, p50, p95, p99, max} in ns.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_getStatsImpl(JNIEnv *env, jobject thiz,
+                                                               jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    NormalizerStats stats = pNormalizer->stats();
+
+    std::vector<int64_t> values;
+    AppendLatencySummary(stats.total, &values);
+    values.push_back(stats.cache_hits);
+    values.push_back(stats.stages.size());
+    for (const NormalizerStageStats &stage : stats.stages) {
+        values.insert(values.end(), {(int64_t) stage.calls, (int64_t) stage.states,
+                                     (int64_t) stage.arcs, (int64_t) stage.input_bytes,
+                                     (int64_t) stage.output_bytes,
+                                     (int64_t) stage.empty_outputs});
+        AppendLatencySummary(stage.latency, &values);
+        AppendLatencySummary(stage.compose, &values);
+        AppendLatencySummary(stage.search, &values);
+    }
+    jlongArray result = env->NewLongArray(values.size());
+    env->SetLongArrayRegion(result, 0, values.size(), (const jlong *) values.data());
+    return result;
+}
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_getStageNamesImpl(JNIEnv *env, jobject thiz,
+                                                                    jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    NormalizerStats stats = pNormalizer->stats();
+
+    jobjectArray result = env->NewObjectArray(stats.stages.size(),
+                                              env->FindClass("java/lang/String"), nullptr);
+    for (size_t i = 0; i < stats.stages.size(); ++i) {
+        jstring name = env->NewStringUTF(stats.stages[i].name.c_str());
+        env->SetObjectArrayElement(result, i, name);
+        env->DeleteLocalRef(name);
+    }
+    return result;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_resetStatsImpl(JNIEnv *env, jobject thiz,
+                                                                 jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    pNormalizer->resetStats();
+}
+
+// One line per slow request:
+// "<total us> us [cache hit] | stage <i>: <us> us (compose <us>, search <us>),
+//  <states> states, <arcs> arcs, <bytes> bytes | ... | <input>"
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_com_StandaloneTTS_OfflineTts_00024Normalizer_getSlowTracesImpl(JNIEnv *env, jobject thiz,
+                                                                    jlong ptr) {
+    jclass c = env->GetObjectClass(thiz);
+    jfieldID fid_handle = env->GetFieldID(c, "ptr", "J");
+    auto *pNormalizer = (Normalizer*) env->GetLongField(thiz, fid_handle);
+    std::vector<NormalizerTrace> traces = pNormalizer->slowTraces();
+
+    jobjectArray result = env->NewObjectArray(traces.size(),
+                                              env->FindClass("java/lang/String"), nullptr);
+    char buf[192];
+    for (size_t i = 0; i < traces.size(); ++i) {
+        const NormalizerTrace &trace = traces[i];
+        snprintf(buf, sizeof(buf), "%" PRIu64 " us%s", trace.total_ns / 1000,
+                 trace.cache_hit ? " cache hit" : "");
+        std::string line = buf;
+        for (size_t j = 0; j < trace.stages.size(); ++j) {
+            const NormalizerTrace::Stage &stage = trace.stages[j];
+            snprintf(buf, sizeof(buf),
+                     " | stage %zu: %" PRIu64 " us (compose %" PRIu64 ", search %" PRIu64
+                     "), %" PRIu64 " states, %" PRIu64 " arcs, %" PRIu64 " bytes",
+                     j, stage.total_ns / 1000, stage.compose_ns / 1000, stage.search_ns / 1000,
+                     stage.states, stage.arcs, stage.output_bytes);
+            line += buf;
+        }
+        line += " | ";
+        line += trace.input;
+        jstring text = env->NewStringUTF(line.c_str());
+        env->SetObjectArrayElement(result, i, text);
+        env->DeleteLocalRef(text);
+    }
+    return result;
+}
 
 extern "C"
 JNIEXPORT void JNICALL
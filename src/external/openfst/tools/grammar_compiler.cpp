@@ -0,0 +1,552 @@
+//
+// Offline compiler of the normalization grammars.
+//
+// Usage: grammar_compiler [options] <far_list> <output>
+//        grammar_compiler --info <archive>
+//   --check-corpus <file>  one input per line, in a form the FARs accept.
+//                          Needed by --optimize and --fuse-max-arcs, which
+//                          are undone for a rule when they change the output
+//                          of any line. Also reports the normalization
+//                          latency of the corpus before and after
+//   --optimize             encode, determinize and minimize each rule, and
+//                          keep the result if it is smaller
+//   --max-growth <x>       stop determinizing a rule once it has x times its
+//                          states, default 4
+//   --fuse-max-arcs <n>    compose adjacent rules into one when the result has
+//                          at most n arcs, default 0 (disabled)
+//   --type <auto|const|const16|packed32|packed64>
+//                          representation of the rules, default auto: the
+//                          smallest that holds each rule, as allowed by
+//                          --prefer
+//   --prefer <latency|size>
+//                          what auto picks for, default latency: only the
+//                          const types. size also allows the packed types,
+//                          which are smaller but slower to search
+//   --repeat <n>           timed corpus passes for the latency, default 20
+//
+// The rules of the FARs in far_list are written, in order, to one grammar
+// archive (see grammar_archive.h) that Normalizer accepts in place of the far
+// list. Every rule is arc-sorted on input labels. The archive description
+// records the source and the changes of each rule.
+//
+// Determinization may change which of several equal cost paths the
+// normalizer picks, and a fused rule picks the best path through both rules
+// instead of the best path of each in turn, hence the corpus check.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fst/arcsort.h"
+#include "fst/compose.h"
+#include "fst/connect.h"
+#include "fst/determinize.h"
+#include "fst/encode.h"
+#include "fst/extensions/far/farlib.h"
+#include "fst/minimize.h"
+#include "fst/rmepsilon.h"
+#include "fst/vector-fst.h"
+
+#include "grammar_archive.h"
+#include "openfst_api.h"
+
+using fst::StdArc;
+using fst::StdVectorFst;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string far_list;
+    std::string output;
+    std::string corpus;
+    bool optimize = false;
+    double max_growth = 4;
+    size_t fuse_max_arcs = 0;
+    std::string type = "auto";
+    bool prefer_size = false;
+    int repeat = 20;
+};
+
+// A rule being compiled, with the size of the rules it came from.
+struct Rule {
+    std::string source;  // "<far>#<i>", joined by "+" once fused
+    std::unique_ptr<StdVectorFst> fst;
+    std::vector<std::string> changes;
+    size_t states_before = 0;
+    size_t arcs_before = 0;
+    size_t bytes_before = 0;
+};
+
+static size_t NumArcs(const fst::Fst<StdArc> &rule) {
+    size_t arcs = 0;
+    for (fst::StateIterator<fst::Fst<StdArc>> siter(rule); !siter.Done(); siter.Next()) {
+        arcs += rule.NumArcs(siter.Value());
+    }
+    return arcs;
+}
+
+static size_t NumStates(const fst::Fst<StdArc> &rule) {
+    size_t states = 0;
+    for (fst::StateIterator<fst::Fst<StdArc>> siter(rule); !siter.Done(); siter.Next()) {
+        ++states;
+    }
+    return states;
+}
+
+// Size of the aligned image of rule, as written to an archive or cache.
+static size_t ImageBytes(const fst::Fst<StdArc> &rule) {
+    std::ostringstream strm;
+    rule.Write(strm, fst::FstWriteOptions("image", /*write_header=*/true,
+                                          /*write_isymbols=*/false,
+                                          /*write_osymbols=*/false,
+                                          /*align=*/true));
+    return strm.str().size();
+}
+
+// Size of rule as the normalizer holds a FAR rule: a ConstFst.
+static size_t ConstBytes(const StdVectorFst &rule) {
+    return ImageBytes(fst::StdConstFst(rule));
+}
+
+static std::vector<std::string> FarFiles(const std::string &far_list) {
+    std::vector<std::string> files;
+    std::istringstream is(far_list);
+    std::string f;
+    while (std::getline(is, f, ',')) {
+        if (!f.empty()) files.push_back(f);
+    }
+    return files;
+}
+
+static bool LoadRules(const std::string &far_list, std::vector<Rule> *rules) {
+    for (const auto &f : FarFiles(far_list)) {
+        std::unique_ptr<fst::FarReader<StdArc>> reader(fst::FarReader<StdArc>::Open(f));
+        if (!reader) {
+            fprintf(stderr, "Cannot read %s\n", f.c_str());
+            return false;
+        }
+        for (int i = 0; !reader->Done(); reader->Next(), ++i) {
+            Rule rule;
+            rule.source = f + "#" + std::to_string(i);
+            rule.fst = std::make_unique<StdVectorFst>(*reader->GetFst());
+            rule.states_before = rule.fst->NumStates();
+            rule.arcs_before = NumArcs(*rule.fst);
+            rule.bytes_before = ConstBytes(*rule.fst);
+            rules->push_back(std::move(rule));
+        }
+    }
+    return !rules->empty();
+}
+
+// Copies the states of the lazy FST reachable from its start into out.
+// Returns false once it exceeds max_states states or max_arcs arcs. The
+// state IDs of the lazy FSTs used here are dense, so they are kept.
+static bool ExpandWithin(const fst::Fst<StdArc> &lazy, size_t max_states, size_t max_arcs,
+                         StdVectorFst *out) {
+    using StateId = StdArc::StateId;
+    out->DeleteStates();
+    const StateId start = lazy.Start();
+    if (start == fst::kNoStateId) return true;
+
+    std::vector<bool> seen;
+    std::queue<StateId> queue;
+    auto visit = [&](StateId s) {
+        if (static_cast<size_t>(s) >= seen.size()) seen.resize(s + 1, false);
+        if (seen[s]) return;
+        seen[s] = true;
+        queue.push(s);
+        while (out->NumStates() <= s) out->AddState();
+    };
+    visit(start);
+    out->SetStart(start);
+
+    size_t arcs = 0;
+    while (!queue.empty()) {
+        const StateId s = queue.front();
+        queue.pop();
+        if (static_cast<size_t>(out->NumStates()) > max_states) return false;
+        out->SetFinal(s, lazy.Final(s));
+        for (fst::ArcIterator<fst::Fst<StdArc>> aiter(lazy, s); !aiter.Done(); aiter.Next()) {
+            const StdArc &arc = aiter.Value();
+            if (++arcs > max_arcs) return false;
+            visit(arc.nextstate);
+            out->AddArc(s, arc);
+        }
+    }
+    return true;
+}
+
+// Determinizes and minimizes rule as an acceptor of (input, output, weight)
+// triples, which keeps its weighted relation. Returns null if the result
+// grows past max_growth times the states of rule.
+static std::unique_ptr<StdVectorFst> Optimize(const StdVectorFst &rule, double max_growth) {
+    StdVectorFst encoded(rule);
+    fst::EncodeMapper<StdArc> encoder(fst::kEncodeLabels | fst::kEncodeWeights);
+    fst::Encode(&encoded, &encoder);
+
+    fst::DeterminizeFst<StdArc> lazy(encoded);
+    auto result = std::make_unique<StdVectorFst>();
+    const size_t max_states = static_cast<size_t>(max_growth * rule.NumStates());
+    if (!ExpandWithin(lazy, max_states, std::numeric_limits<size_t>::max(), result.get())) {
+        return nullptr;
+    }
+    fst::Minimize(result.get());
+    fst::Decode(result.get(), encoder);
+    // Final weights come back as epsilon arcs into a super-final state.
+    fst::RmEpsilon(result.get());
+    fst::ArcSort(result.get(), fst::ILabelCompare<StdArc>());
+    return result;
+}
+
+// Composes first with second, or returns null if the result has more than
+// max_arcs arcs.
+static std::unique_ptr<StdVectorFst> Fuse(const StdVectorFst &first, const StdVectorFst &second,
+                                          size_t max_arcs) {
+    fst::ComposeFst<StdArc> lazy(first, second);
+    auto fused = std::make_unique<StdVectorFst>();
+    if (!ExpandWithin(lazy, std::numeric_limits<size_t>::max(), max_arcs, fused.get())) {
+        return nullptr;
+    }
+    fst::Connect(fused.get());
+    fst::ArcSort(fused.get(), fst::ILabelCompare<StdArc>());
+    return fused;
+}
+
+template <class Element, class Unsigned>
+static std::unique_ptr<fst::Fst<StdArc>> MakePacked(const StdVectorFst &rule) {
+    using Packed = PackedFst<Element, Unsigned>;
+    auto arc_compactor = std::make_shared<PackedArcCompactor<Element>>();
+    if (!arc_compactor->Init(rule)) return nullptr;
+    auto compactor = std::make_shared<typename Packed::Compactor>(arc_compactor, nullptr);
+    return std::make_unique<Packed>(rule, compactor);
+}
+
+// Converts rule to the given type, or to the smallest type that holds it for
+// "auto", among the packed types too if prefer_size. Returns null if rule
+// does not fit into the type.
+static std::unique_ptr<fst::Fst<StdArc>> Convert(const StdVectorFst &rule, const std::string &type,
+                                                 bool prefer_size) {
+    const size_t arcs = NumArcs(rule);
+    size_t compacts = arcs;
+    for (fst::StateIterator<StdVectorFst> siter(rule); !siter.Done(); siter.Next()) {
+        if (rule.Final(siter.Value()) != StdArc::Weight::Zero()) ++compacts;
+    }
+    const bool small = compacts <= std::numeric_limits<uint16_t>::max();
+
+    std::vector<std::unique_ptr<fst::Fst<StdArc>>> candidates;
+    if (type == "auto" || type == "const") {
+        candidates.push_back(std::make_unique<fst::StdConstFst>(rule));
+    }
+    if ((type == "auto" || type == "const16") && arcs <= std::numeric_limits<uint16_t>::max()) {
+        candidates.push_back(std::make_unique<Const16Fst>(rule));
+    }
+    const bool auto_packed = type == "auto" && prefer_size;
+    if (auto_packed || type == "packed32") {
+        candidates.push_back(small ? MakePacked<uint32_t, uint16_t>(rule)
+                                   : MakePacked<uint32_t, uint32_t>(rule));
+    }
+    if (auto_packed || type == "packed64") {
+        candidates.push_back(small ? MakePacked<uint64_t, uint16_t>(rule)
+                                   : MakePacked<uint64_t, uint32_t>(rule));
+    }
+
+    std::unique_ptr<fst::Fst<StdArc>> best;
+    size_t best_bytes = 0;
+    for (auto &candidate : candidates) {
+        if (!candidate || candidate->Properties(fst::kError, false)) continue;
+        const size_t bytes = ImageBytes(*candidate);
+        if (!best || bytes < best_bytes) {
+            best = std::move(candidate);
+            best_bytes = bytes;
+        }
+    }
+    return best;
+}
+
+// Writes rules to an archive at path; with info, the description records the
+// compilation of each rule.
+static bool WriteArchive(const std::string &path, const std::vector<Rule> &rules,
+                         const std::string &type, bool prefer_size,
+                         std::string *info = nullptr) {
+    std::vector<std::unique_ptr<fst::Fst<StdArc>>> converted;
+    std::vector<const fst::Fst<StdArc> *> to_write;
+    std::ostringstream description;
+    description << "grammar_compiler, " << rules.size() << " rules\n";
+    for (size_t i = 0; i < rules.size(); ++i) {
+        const Rule &rule = rules[i];
+        converted.push_back(Convert(*rule.fst, type, prefer_size));
+        if (!converted.back()) {
+            fprintf(stderr, "Rule %zu (%s) does not fit into %s\n", i, rule.source.c_str(),
+                    type.c_str());
+            return false;
+        }
+        to_write.push_back(converted.back().get());
+
+        description << "rule " << i << ": " << rule.source << "\n"
+                    << "  type " << converted.back()->Type() << ", ilabel sorted";
+        for (const auto &change : rule.changes) description << ", " << change;
+        description << "\n  states " << rule.states_before << " -> " << rule.fst->NumStates()
+                    << ", arcs " << rule.arcs_before << " -> " << NumArcs(*rule.fst)
+                    << ", bytes " << rule.bytes_before << " -> " << ImageBytes(*converted.back())
+                    << "\n";
+    }
+    if (info) *info = description.str();
+    return GrammarArchive::Write(path, description.str(), to_write);
+}
+
+static NormalizerConfig CheckConfig() {
+    NormalizerConfig config;
+    config.num_threads = 1;
+    config.use_cache = false;
+    config.cache_capacity_bytes = 0;
+    return config;
+}
+
+static std::vector<std::string> Outputs(const std::string &far_list,
+                                        const std::vector<std::string> &corpus) {
+    Normalizer normalizer(far_list, CheckConfig());
+    std::vector<std::string> outputs;
+    outputs.reserve(corpus.size());
+    for (const auto &line : corpus) outputs.push_back(normalizer.apply(line));
+    return outputs;
+}
+
+// Latency of Normalizer::apply over the corpus with the rules of each list,
+// in us per line. Passes over the corpus alternate between the two, after
+// one untimed pass each, and the median pass counts.
+static std::pair<double, double> CompareLatencyUs(const std::string &before_list,
+                                                  const std::string &after_list,
+                                                  const std::vector<std::string> &corpus,
+                                                  int repeat) {
+    Normalizer before(before_list, CheckConfig());
+    Normalizer after(after_list, CheckConfig());
+    auto pass = [&](Normalizer &normalizer) {
+        const auto start = Clock::now();
+        for (const auto &line : corpus) normalizer.apply(line);
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count() /
+               corpus.size();
+    };
+    pass(before);
+    pass(after);
+    std::vector<double> before_us, after_us;
+    for (int r = 0; r < repeat; ++r) {
+        before_us.push_back(pass(before));
+        after_us.push_back(pass(after));
+    }
+    std::sort(before_us.begin(), before_us.end());
+    std::sort(after_us.begin(), after_us.end());
+    return {before_us[repeat / 2], after_us[repeat / 2]};
+}
+
+static int PrintInfo(const std::string &path) {
+    std::vector<std::unique_ptr<fst::Fst<StdArc>>> rules;
+    std::string info;
+    if (!GrammarArchive::Read(path, &rules, &info)) {
+        fprintf(stderr, "Cannot read grammar archive %s\n", path.c_str());
+        return 1;
+    }
+    printf("%s", info.c_str());
+    for (size_t i = 0; i < rules.size(); ++i) {
+        printf("loaded rule %zu: type %s, states %zu, arcs %zu\n", i, rules[i]->Type().c_str(),
+               NumStates(*rules[i]), NumArcs(*rules[i]));
+    }
+    return 0;
+}
+
+static void Usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] <far_list> <output>\n"
+                    "       %s --info <archive>\n"
+                    "See the top of grammar_compiler.cpp for the options.\n", argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--info") {
+            return PrintInfo(value());
+        } else if (arg == "--check-corpus") {
+            opts.corpus = value();
+        } else if (arg == "--optimize") {
+            opts.optimize = true;
+        } else if (arg == "--max-growth") {
+            opts.max_growth = atof(value());
+        } else if (arg == "--fuse-max-arcs") {
+            opts.fuse_max_arcs = strtoull(value(), nullptr, 10);
+        } else if (arg == "--type") {
+            opts.type = value();
+        } else if (arg == "--prefer") {
+            const std::string prefer = value();
+            if (prefer != "latency" && prefer != "size") {
+                Usage(argv[0]);
+                return 1;
+            }
+            opts.prefer_size = prefer == "size";
+        } else if (arg == "--repeat") {
+            opts.repeat = std::max(1, atoi(value()));
+        } else if (arg.compare(0, 2, "--") == 0) {
+            Usage(argv[0]);
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+    opts.far_list = positional[0];
+    opts.output = positional[1];
+    if ((opts.optimize || opts.fuse_max_arcs > 0) && opts.corpus.empty()) {
+        fprintf(stderr, "--optimize and --fuse-max-arcs need --check-corpus\n");
+        return 1;
+    }
+
+    std::vector<std::string> corpus;
+    if (!opts.corpus.empty()) {
+        std::ifstream is(opts.corpus);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (!line.empty()) corpus.push_back(line);
+        }
+        if (corpus.empty()) {
+            fprintf(stderr, "No lines in %s\n", opts.corpus.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<Rule> rules;
+    if (!LoadRules(opts.far_list, &rules)) return 1;
+    for (auto &rule : rules) {
+        if (!rule.fst->Properties(fst::kILabelSorted, true)) {
+            fst::ArcSort(rule.fst.get(), fst::ILabelCompare<StdArc>());
+            rule.changes.push_back("arc-sorted");
+        }
+    }
+
+    // Rewrites are checked end to end, through the same Normalizer as on
+    // the device, against the outputs of the FARs.
+    std::vector<std::string> expected;
+    if (!corpus.empty()) expected = Outputs(opts.far_list, corpus);
+    const std::string check_path = opts.output + ".check" + std::to_string(getpid());
+    auto unchanged = [&]() {
+        return WriteArchive(check_path, rules, opts.type, opts.prefer_size) &&
+               Outputs(check_path, corpus) == expected;
+    };
+
+    if (opts.fuse_max_arcs > 0) {
+        for (size_t i = 0; i + 1 < rules.size();) {
+            auto fused = Fuse(*rules[i].fst, *rules[i + 1].fst, opts.fuse_max_arcs);
+            if (!fused) {
+                printf("fuse %s + %s: over %zu arcs\n", rules[i].source.c_str(),
+                       rules[i + 1].source.c_str(), opts.fuse_max_arcs);
+                ++i;
+                continue;
+            }
+            std::vector<Rule> fused_rules;
+            for (size_t j = 0; j < rules.size(); ++j) {
+                if (j == i + 1) continue;
+                Rule rule;
+                rule.source = rules[j].source;
+                rule.changes = rules[j].changes;
+                rule.states_before = rules[j].states_before;
+                rule.arcs_before = rules[j].arcs_before;
+                rule.bytes_before = rules[j].bytes_before;
+                if (j == i) {
+                    const Rule &next = rules[i + 1];
+                    rule.source += "+" + next.source;
+                    rule.changes.push_back("fused");
+                    rule.states_before += next.states_before;
+                    rule.arcs_before += next.arcs_before;
+                    rule.bytes_before += next.bytes_before;
+                    rule.fst = std::move(fused);
+                } else {
+                    rule.fst = std::make_unique<StdVectorFst>(*rules[j].fst);
+                }
+                fused_rules.push_back(std::move(rule));
+            }
+            std::swap(rules, fused_rules);
+            if (unchanged()) {
+                printf("fuse %s: %zu arcs\n", rules[i].source.c_str(), NumArcs(*rules[i].fst));
+            } else {
+                std::swap(rules, fused_rules);
+                printf("fuse %s + %s: changes the output\n", rules[i].source.c_str(),
+                       rules[i + 1].source.c_str());
+                ++i;
+            }
+        }
+    }
+
+    if (opts.optimize) {
+        for (auto &rule : rules) {
+            auto optimized = Optimize(*rule.fst, opts.max_growth);
+            const char *result;
+            if (!optimized) {
+                result = "over the growth limit";
+            } else if (ConstBytes(*optimized) >= ConstBytes(*rule.fst)) {
+                result = "not smaller";
+            } else {
+                std::swap(rule.fst, optimized);
+                if (unchanged()) {
+                    result = "optimized";
+                    rule.changes.push_back("determinized and minimized");
+                } else {
+                    std::swap(rule.fst, optimized);
+                    result = "changes the output";
+                }
+            }
+            printf("optimize %s: %s\n", rule.source.c_str(), result);
+        }
+    }
+    unlink(check_path.c_str());
+
+    std::string info;
+    if (!WriteArchive(opts.output, rules, opts.type, opts.prefer_size, &info)) {
+        fprintf(stderr, "Cannot write %s\n", opts.output.c_str());
+        return 1;
+    }
+    printf("%s", info.c_str());
+
+    size_t far_bytes = 0, const_bytes = 0, archive_bytes = 0;
+    for (const auto &f : FarFiles(opts.far_list)) {
+        std::ifstream is(f, std::ios_base::binary | std::ios_base::ate);
+        far_bytes += static_cast<size_t>(is.tellg());
+    }
+    for (const auto &rule : rules) const_bytes += rule.bytes_before;
+    {
+        std::ifstream is(opts.output, std::ios_base::binary | std::ios_base::ate);
+        archive_bytes = static_cast<size_t>(is.tellg());
+    }
+    printf("size: FARs %zu bytes, as ConstFst %zu bytes, archive %zu bytes\n",
+           far_bytes, const_bytes, archive_bytes);
+
+    if (!corpus.empty()) {
+        if (Outputs(opts.output, corpus) != expected) {
+            fprintf(stderr, "The archive changes the output of the corpus\n");
+            return 1;
+        }
+        const auto latency = CompareLatencyUs(opts.far_list, opts.output, corpus, opts.repeat);
+        printf("latency: %.1f us per line before, %.1f us after (median of %d passes over %zu lines)\n",
+               latency.first, latency.second, opts.repeat, corpus.size());
+    }
+    return 0;
+}